@@ -23,6 +23,7 @@
  
 #define _GNU_SOURCE             /* To get DN_* constants from <fcntl.h> */
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -32,23 +33,37 @@
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h> // for usleep
 #include <math.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/eventfd.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <regex.h>
 #include <sched.h>
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef LA_HEADLESS
 #include <gtk/gtk.h>
+#endif
+#include "la_decoder.h"
+#include "la_index.h"
+#include "la_pyramid.h"
+#include "la_queue.h"
+#include "la_transpose.h"
+#include "la_wave.h"
+#include "la_writer.h"
  
 #define SAMP_SRAM_PACKET_SIZE (256*2)
+#define TTY_RING_SIZE (64*1024)  /* power of 2 */
 #define SAMP_DDR_BUFFER_SIZE (1024*1024)
 
 #define TTY_CTRL_OPTS (CS8 | CLOCAL | CREAD)
@@ -70,9 +85,22 @@
  
 #define RPMSG_SDB_IOCTL_SET_EFD _IOW('R', 0x00, struct rpmsg_sdb_ioctl_set_efd *)
 #define RPMSG_SDB_IOCTL_GET_DATA_SIZE _IOWR('R', 0x01, struct rpmsg_sdb_ioctl_get_data_size *)
+#define RPMSG_SDB_IOCTL_SETUP_RING _IOW('R', 0x02, struct rpmsg_sdb_ioctl_setup_ring *)
+#define RPMSG_SDB_IOCTL_SET_MAP_MODE _IOW('R', 0x03, struct rpmsg_sdb_ioctl_set_map_mode *)
+#define RPMSG_SDB_IOCTL_BEGIN_CPU_ACCESS _IOW('R', 0x04, struct rpmsg_sdb_ioctl_cpu_access *)
+#define RPMSG_SDB_IOCTL_END_CPU_ACCESS _IOW('R', 0x05, struct rpmsg_sdb_ioctl_cpu_access *)
+#define RPMSG_SDB_IOCTL_ALLOC_POOL _IOWR('R', 0x06, struct rpmsg_sdb_ioctl_alloc_pool *)
+#define RPMSG_SDB_IOCTL_RELEASE_BUFFER _IOW('R', 0x07, struct rpmsg_sdb_ioctl_release_buffer *)
+#define RPMSG_SDB_IOCTL_ATTACH _IOR('R', 0x08, struct rpmsg_sdb_ioctl_attach *)
+#define RPMSG_SDB_POOL_MMAP_OFFSET 0x20000000UL
+#define RPMSG_SDB_RING_MMAP_OFFSET 0x40000000UL
+#define RPMSG_SDB_POOL_CACHED 0x1
  
 #define TIMEOUT 60
 #define NB_BUF 10
+#define RING_ENTRIES 64
+/* completions parked while an older one is missing, the M4 keeps one buffer to fill */
+#define REORDER_WINDOW (NB_BUF - 1)
  
 typedef struct
 {
@@ -84,6 +112,66 @@ typedef struct
     int bufferId;
     uint32_t size;
 } rpmsg_sdb_ioctl_get_data_size;
+
+typedef struct
+{
+    uint32_t entries;
+    int eventfd;
+} rpmsg_sdb_ioctl_setup_ring;
+
+typedef struct
+{
+    uint32_t cached;
+} rpmsg_sdb_ioctl_set_map_mode;
+
+typedef struct
+{
+    int bufferId;
+} rpmsg_sdb_ioctl_cpu_access;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t size;
+    uint32_t flags;
+} rpmsg_sdb_ioctl_alloc_pool;
+
+typedef struct
+{
+    int bufferId;
+} rpmsg_sdb_ioctl_release_buffer;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t size;
+    uint32_t flags;
+} rpmsg_sdb_ioctl_attach;
+
+// completion ring shared with the SDB driver, see stm32_rpmsg_sdb.c
+typedef struct
+{
+    uint32_t buffer_id;
+    uint32_t size;
+    uint32_t seq;
+    uint32_t flags;
+    uint64_t timestamp;
+} rpmsg_sdb_ring_entry;
+
+#define RPMSG_SDB_RING_F_OVERRUN 0x1
+
+typedef struct
+{
+    uint32_t producer;
+    uint32_t pad0[15];
+    uint32_t consumer;
+    uint32_t pad1[15];
+    uint32_t entries;
+    uint32_t dropped;
+    uint32_t overruns;
+    uint32_t pad2[13];
+    rpmsg_sdb_ring_entry entry[];
+} rpmsg_sdb_ring;
  
 struct connection_info_struct
 {
@@ -104,10 +192,12 @@ typedef enum {
 } machine_state_t;
 
 static char machine_state_str[5][13] = {"READY", "SAMPLING_LOW", "SAMPLING_HIGH"};
+#ifndef LA_HEADLESS
 static char SELECTED[10] = {" selected"};
 static char NOT_SELECTED[10] = {""};
 static char freq_unit_str[3][4] = {"MHz", "kHz", "Hz"};
 static char FREQU[3] = {'M', 'k', 'H'};
+#endif
 
 /* The file descriptor used to manage our TTY over RPMSG */
 static int mFdRpmsg[2] = {-1, -1};
@@ -116,31 +206,132 @@ static int mFdRpmsg[2] = {-1, -1};
 static int mFdSdbRpmsg = -1;
 
 static int virtual_tty_send_command(int len, char* commandStr);
+static void capture_stop(const char *reason);
+static void event_loop_watch(int fd, int on);
 
-static char mByteBuffer[512];
-static char mByteBuffCpy[512];
-static int mNbReadTty = 0;
+/*
+ * tty0 low rate data is drained in batches into this ring: readv fills it at
+ * mTtyRingHead, the event loop accounts for it up to mTtyRingSeen and hands
+ * it over to the analysis up to mTtyRingSubmitted, which frees it up to
+ * mTtyRingTail.
+ */
+static unsigned char mTtyRing[TTY_RING_SIZE];
+static uint32_t mTtyRingHead = 0, mTtyRingTail = 0;
+static uint32_t mTtyRingSeen = 0, mTtyRingSubmitted = 0;
+static uint8_t mTty0Paused = 0;
+static uint8_t mFirstByte;
 
 static char mRxTraceBuffer[512];
 
 static char mSamplingStr[15];
 static int32_t mSampFreq_Hz = 4;
 static machine_state_t mMachineState;
+#ifndef UI_REFRESH_HZ
+#define UI_REFRESH_HZ 10        /* label refresh rate, LA_UI_HZ overrides it */
+#endif
 static int32_t mSampParmCount;
-static uint8_t mExitRequested = 0, mErrorDetected = 0;
+static uint8_t mExitRequested = 0;
 static uint32_t mNbUncompData=0, mNbWrittenInFileData;
 static uint32_t mNbUncompMB=0, mNbPrevUncompMB=0, mNbTty0Frame=0;
-static uint8_t mDdrBuffAwaited;
 static uint8_t mThreadCancel = 0;
+static uint8_t mRecordRequested = 0;
+/* the SDB completions of the recording are spliced by the writer, not copied */
+static uint8_t mRecordSplice = 0;
+
+/* the event loop is the only writer of the state and counters shown by the UI */
+#define SHARED_SET(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#define SHARED_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
 
 void* mmappedData[NB_BUF];
+static void* mmappedPool = NULL;
 static    int fMappedData = 0;
-FILE *pOutFile = NULL;
 static char mFileNameStr[150];
-static pthread_t threadTTY, threadSDB, threadUI;
+static pthread_t threadEvent;
+
+/* Single event loop: completion ring, both ttyRPMSG and the control eventfd */
+static int mEpollFd = -1;
+static int mCtrlEfd = -1;
+
+/* commands posted to the event loop by the other threads */
+#define LA_CMD_START 1          /* id: sampling frequency */
+#define LA_CMD_STOP 2
+#define LA_CMD_F_SETDATA 0x1
+#define LA_CMD_F_RECORD 0x2
+#define CTRL_QUEUE_ENTRIES 16
+static la_mpmc mCtrlQueue;
+static la_mpmc_cell mCtrlCells[CTRL_QUEUE_ENTRIES];
+
+static int mRingEfd = -1;
+static rpmsg_sdb_ring *mRing = NULL;
+static size_t mRingSize;
+static uint32_t mRingDropped = 0;
+static uint32_t mNbOverruns = 0;
+
+/* reorder window, indexed by seq % NB_BUF, owned by the event loop */
+static rpmsg_sdb_ring_entry mReorder[NB_BUF];
+static uint8_t mReorderValid[NB_BUF];
+static uint32_t mReorderPending = 0;
+static uint32_t mSeqNext = 0;
+static uint8_t mSeqStarted = 0;
+static uint32_t mNbSkipped = 0, mNbLate = 0;
+
+/* analysis stage, decodes the captured data on its own thread */
+#define LA_DESC_SDB 1           /* id: SDB buffer, released once analysed */
+#define LA_DESC_TTY 2           /* data: tty ring, freed once analysed */
+#define LA_DESC_RESET 3         /* a new capture starts */
+#define LA_DESC_F_LATE 0x1      /* SDB data completed before data already analysed */
+#define ANA_QUEUE_ENTRIES 32
+#define ANA_OUT_SAMPLES (64*1024)
+static la_spsc mAnaQueue, mAnaDone;
+static la_desc mAnaQueueSlot[ANA_QUEUE_ENTRIES], mAnaDoneSlot[ANA_QUEUE_ENTRIES];
+static uint32_t mAnaInFlight = 0;
+static sem_t mAnaSem;
+static int mAnaEfd = -1;
+static uint8_t mAnaRunning = 0;
+static pthread_t threadAnalysis;
+static la_decoder mDecoder;
+static uint8_t mSamples[ANA_OUT_SAMPLES];
+static uint64_t mNbSamples = 0;
+/* samples decoded from late completions, appended out of capture order */
+static uint64_t mNbLateSamples = 0;
+static uint8_t mLastSample = 0;
+static la_transposer mTransposer;
+static uint8_t mPlaneData[LA_NB_CHANNELS][ANA_OUT_SAMPLES / 8 + 1];
+static uint8_t *const mPlanes[LA_NB_CHANNELS] = {
+    mPlaneData[0], mPlaneData[1], mPlaneData[2], mPlaneData[3], mPlaneData[4]
+};
+static uint64_t mNbPlaneSamples = 0;
+static uint64_t mChannelHigh[LA_NB_CHANNELS];
+#define ANA_INDEX_MAX_BYTES (64*1024*1024)
+static la_index mIndex;
+static uint64_t mChannelEdges[LA_NB_CHANNELS];
+#define ANA_PYRAMID_MAX_BYTES (32*1024*1024)
+static la_pyramid mPyramid;
+#define WAVE_PERIOD_MS 40       /* waveform refresh while data comes in */
+static la_wave mWave;
+static uint64_t mWaveLastMs = 0, mWaveDueMs = 0;
+static la_wave_view mWaveView;          /* owned by the UI once it runs */
+
+/* control socket, drives the capture without the GUI, one command per line */
+#define CTRL_SOCKET_PATH "/tmp/la_backend.sock" /* LA_CTRL_SOCKET overrides it */
+#define CTRL_MAX_CLIENTS 4
+#define CTRL_LINE_MAX 128
+typedef struct
+{
+    int fd;
+    uint32_t len;
+    uint8_t discard;        /* skipping the end of a line too long */
+    char line[CTRL_LINE_MAX];
+} ctrl_client;
+static int mCtrlSock = -1;
+static char mCtrlSockPath[108];
+static ctrl_client mCtrlClients[CTRL_MAX_CLIENTS];
 
-static int efd[NB_BUF];
-static struct pollfd fds[NB_BUF];
+#ifdef LA_HEADLESS
+static uint8_t mHeadless = 1;
+#else
+static uint8_t mHeadless = 0;           /* --headless, or no display */
+static pthread_t threadUI;
 
 static    GtkWidget *window;
 static    GtkWidget *f_scale;
@@ -162,6 +353,21 @@ static    GtkWidget *data_label;
 static    GtkWidget *data_value;
 static    GtkWidget *butSingle;
 static    GtkWidget *notchSetdata;
+static    GtkWidget *notchRecord;
+static    GtkWidget *record_label;
+static    GtkWidget *record_value;
+static    GtkWidget *samples_label;
+static    GtkWidget *samples_value;
+static    GtkWidget *channels_label;
+static    GtkWidget *channels_value;
+static    GtkWidget *wave_label;
+static    GtkWidget *wave_area;
+static    GtkWidget *notchFollow;
+static    cairo_surface_t *mWaveSurface = NULL;
+static    la_wave_frame mWaveDrawn;     /* geometry and valid columns on the surface */
+static    double mWaveDragX;
+static    uint64_t mWaveDragStart;
+#endif /* LA_HEADLESS */
 
 /********************************************************************************
 Copro functions allowing to manage a virtual TTY over RPMSG
@@ -378,22 +584,28 @@ int copro_writeTtyRpmsg(int ttyNb, int len, char* pData)
  
 int copro_readTtyRpmsg(int ttyNb, int len, char* pData)
 {
-    int byte_rd, byte_avail;
     int result = 0;
     if (mFdRpmsg[ttyNb%2] < 0) {
         printf("CA7 : Error reading ttyRPMSG%d, fileDescriptor is not set\n", ttyNb%2);
         return mFdRpmsg[ttyNb%2];
     }
-    ioctl(mFdRpmsg[ttyNb%2], FIONREAD, &byte_avail);
-    if (byte_avail > 0) {
-        if (byte_avail >= len) {
-            byte_rd = read (mFdRpmsg[ttyNb%2], pData, len);
-        } else {
-            byte_rd = read (mFdRpmsg[ttyNb%2], pData, byte_avail);
-        }
-        //printf("CA7 : read successfully %d bytes to %p, [0]=0x%x\n", byte_rd, pData, pData[0]);
-        result = byte_rd;
-    } else {
+    // the tty is non blocking: nothing available is not an error
+    result = read (mFdRpmsg[ttyNb%2], pData, len);
+    if (result < 0 && errno == EAGAIN) {
+        result = 0;
+    }
+    return result;
+}
+
+int copro_readvTtyRpmsg(int ttyNb, const struct iovec *iov, int iovcnt)
+{
+    int result = 0;
+    if (mFdRpmsg[ttyNb%2] < 0) {
+        printf("CA7 : Error reading ttyRPMSG%d, fileDescriptor is not set\n", ttyNb%2);
+        return mFdRpmsg[ttyNb%2];
+    }
+    result = readv (mFdRpmsg[ttyNb%2], iov, iovcnt);
+    if (result < 0 && errno == EAGAIN) {
         result = 0;
     }
     return result;
@@ -409,98 +621,138 @@ print_time() {
     printf("Time: %lld\n", (ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000LL));
 }
  
+// wake the event loop up after a state change or an exit request
+static void event_loop_notify(void)
+{
+    uint64_t one = 1;
+
+    if (mCtrlEfd >= 0)
+        write(mCtrlEfd, &one, sizeof(one));
+}
+
+// queue a command for the event loop, callable from any thread
+static int event_loop_post(uint32_t type, uint32_t id, uint32_t flags)
+{
+    la_desc cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = type;
+    cmd.id = id;
+    cmd.flags = flags;
+    if (la_mpmc_push(&mCtrlQueue, &cmd) < 0) {
+        printf("CA7 : control queue full, command %u dropped\n", type);
+        return -1;
+    }
+    event_loop_notify();
+    return 0;
+}
+
+#ifndef LA_HEADLESS
 /********************************************************************************
 GTK UI functions
 *********************************************************************************/
-static void
-open_raw_file(void) {
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    sprintf(mFileNameStr, "/usr/local/demo/la/%04d%02d%02d-%02d%02d%02d.dat",
-        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-    pOutFile = fopen(mFileNameStr,"wb");
-}
- 
-static int32_t
-write_raw_file(unsigned char* pData, unsigned int size) {
-    // perform the write by packets of 4kB
-    int rest2write = size;
-    int index = 0;
-    int size2write = 4096;
-    int writtenSize = 0;
-    do {
-        if (rest2write < 4096) {
-            size2write = rest2write;
-        }
-        writtenSize += fwrite(pData+index, 1, size2write, pOutFile);
-        rest2write -= size2write;
-        index += size2write;
-    } while (rest2write > 0);
-    return writtenSize;
-}
- 
-static void
-close_raw_file(void) {
-    if (pOutFile != NULL) {
-        fclose(pOutFile);
-        pOutFile = NULL;
+/*
+ * The labels are refreshed at a fixed rate from a snapshot of the counters,
+ * whatever the data rate: nothing is formatted when the snapshot didn't
+ * change and only the labels whose text differs are set, the window is never
+ * laid out again.
+ */
+typedef struct
+{
+    machine_state_t state;
+    uint32_t nbUncompMB, nbUncompData, nbTty0Frame;
+    uint8_t firstByte, lastSample, record;
+    la_writer_stats rec;
+    uint64_t nbSamples, nbPlaneSamples;
+    uint64_t channelHigh[LA_NB_CHANNELS], channelEdges[LA_NB_CHANNELS];
+} ui_snapshot;
+
+static ui_snapshot mUiShown;
+
+static void ui_snapshot_take(ui_snapshot *snap)
+{
+    int c;
+
+    // zeroed padding, snapshots are compared with memcmp
+    memset(snap, 0, sizeof(*snap));
+    snap->state = SHARED_GET(mMachineState);
+    snap->nbUncompMB = SHARED_GET(mNbUncompMB);
+    snap->nbUncompData = SHARED_GET(mNbUncompData);
+    snap->nbTty0Frame = SHARED_GET(mNbTty0Frame);
+    snap->firstByte = SHARED_GET(mFirstByte);
+    snap->record = SHARED_GET(mRecordRequested);
+    if (snap->record)
+        la_writer_get_stats(&snap->rec);
+    snap->nbSamples = SHARED_GET(mNbSamples);
+    snap->lastSample = SHARED_GET(mLastSample);
+    snap->nbPlaneSamples = SHARED_GET(mNbPlaneSamples);
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        snap->channelHigh[c] = SHARED_GET(mChannelHigh[c]);
+        snap->channelEdges[c] = SHARED_GET(mChannelEdges[c]);
     }
 }
- 
+
+static void ui_set_label(GtkWidget *label, const char *text)
+{
+    if (strcmp(gtk_label_get_text (GTK_LABEL (label)), text))
+        gtk_label_set_text (GTK_LABEL (label), text);
+}
+
 static gboolean refreshUI_CB (gpointer data)
 {
     char tmpStr[200];
- 
-    if (mMachineState >= STATE_SAMPLING_LOW) {
-        gtk_button_set_label (GTK_BUTTON (butSingle), "Stop");
+    ui_snapshot snap;
+    int c, len = 0;
+
+    ui_snapshot_take(&snap);
+    if (memcmp(&snap, &mUiShown, sizeof(snap)) == 0)
+        return TRUE;
+
+    if (snap.state != mUiShown.state) {
+        gtk_button_set_label (GTK_BUTTON (butSingle), snap.state >= STATE_SAMPLING_LOW ? "Stop" : "Start");
+        ui_set_label(state_value, machine_state_str[snap.state]);
+    }
+    sprintf(tmpStr, "%uMB : %u", snap.nbUncompMB, snap.nbUncompData);
+    ui_set_label(nbRealData_value, tmpStr);
+    sprintf(tmpStr, "%u", snap.nbTty0Frame);
+    ui_set_label(nbRpmsgFrame_value, tmpStr);
+    sprintf(tmpStr, "%x", snap.firstByte);
+    ui_set_label(data_value, tmpStr);
+    if (snap.record) {
+        sprintf(tmpStr, "%.1f MB/s, backlog %u kB%s", snap.rec.rate_MBps, snap.rec.backlog / 1024,
+            snap.rec.error ? ", write error" : (snap.rec.dropped ? ", data dropped" : ""));
     } else {
-        gtk_button_set_label (GTK_BUTTON (butSingle), "Start");
+        sprintf(tmpStr, "off");
     }
-    gtk_label_set_text (GTK_LABEL (state_value), machine_state_str[mMachineState]);
-    sprintf(tmpStr, "%uMB : %u", mNbUncompMB, mNbUncompData);
-    gtk_label_set_text (GTK_LABEL (nbRealData_value), tmpStr);
-    sprintf(tmpStr, "%u", mNbTty0Frame);
-    gtk_label_set_text (GTK_LABEL (nbRpmsgFrame_value), tmpStr);
-    //gtk_label_set_text (GTK_LABEL (fileName_value), mFileNameStr);
-    sprintf(tmpStr, "%x", mByteBuffCpy[0]);
-    gtk_label_set_text (GTK_LABEL (data_value), tmpStr);
-   
-    gtk_widget_show_all(window);
- 
-   return FALSE;
+    ui_set_label(record_value, tmpStr);
+    sprintf(tmpStr, "%llu (PE12..8 = %02x)", (unsigned long long)snap.nbSamples, snap.lastSample);
+    ui_set_label(samples_value, tmpStr);
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        len += sprintf(tmpStr + len, "PE%d %u%% %llu  ", 8 + c, snap.nbPlaneSamples ?
+            (unsigned)(snap.channelHigh[c] * 100 / snap.nbPlaneSamples) : 0,
+            (unsigned long long)snap.channelEdges[c]);
+    }
+    ui_set_label(channels_value, tmpStr);
+
+    mUiShown = snap;
+    return TRUE;
 }
  
 static void single_clicked (GtkWidget *widget, gpointer data)
 {
-    char setData = 'n';
-    if (mMachineState == STATE_READY) {
-        if (mSampFreq_Hz > 5) {
-            mMachineState = STATE_SAMPLING_HIGH;
-        } else {
-            mMachineState = STATE_SAMPLING_LOW;
-        }
-        mNbUncompData=0;
-        mNbPrevUncompMB = 0;
-        mNbUncompMB = 0;
-        mNbWrittenInFileData=0;
-        mDdrBuffAwaited=0;
-        mNbTty0Frame=0;
+    uint32_t flags = 0;
+
+    // the event loop owns the machine state, only ask it for a change
+    if (SHARED_GET(mMachineState) == STATE_READY) {
         if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (notchSetdata))) {
-            setData = 'y';
+            flags |= LA_CMD_F_SETDATA;
         }
-        // build sampling string
-        sprintf(mSamplingStr, "S%03dMs%c", mSampFreq_Hz, setData);
-        printf("CA7 : Start sampling at %dMHz\n", mSampFreq_Hz);
-        virtual_tty_send_command(strlen(mSamplingStr), mSamplingStr);
-        gdk_threads_add_idle (refreshUI_CB, window);
-    } else if (mMachineState >= STATE_SAMPLING_LOW) {
-        mMachineState = STATE_READY;
-        printf("CA7 : Stop sampling\n");
-        virtual_tty_send_command(strlen("Exit"), "Exit");
-        gdk_threads_add_idle (refreshUI_CB, window);
+        if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (notchRecord))) {
+            flags |= LA_CMD_F_RECORD;
+        }
+        event_loop_post(LA_CMD_START, mSampFreq_Hz, flags);
     } else {
-        printf("CA7 : Start sampling param error: mMachineState=%d mSampFreq_Hz=%d \n",
-            mMachineState, mSampFreq_Hz);
+        event_loop_post(LA_CMD_STOP, 0, 0);
     }
 }
  
@@ -518,11 +770,154 @@ static void f_scale_moved (GtkRange *range, gpointer user_data)
    g_free(str);
 }
  
+/*
+ * Waveform: the analysis thread renders the viewport into cells (see
+ * la_wave.h), the UI keeps what it drew on mWaveSurface and only paints the
+ * columns a new frame adds. PE8 is at the top, PE12 at the bottom.
+ */
+static void wave_view_changed(void)
+{
+    la_wave_set_view(&mWave, &mWaveView);
+    // wake the analysis thread up, it renders at once when the view changes
+    sem_post(&mAnaSem);
+}
+
+static void wave_paint(const la_wave_frame *frame)
+{
+    int width = cairo_image_surface_get_width(mWaveSurface);
+    int height = cairo_image_surface_get_height(mWaveSurface);
+    double band = (double)height / LA_NB_CHANNELS;
+    uint32_t first = 0, x;
+    int c, state, prev, same;
+    double high, low;
+    cairo_t *cr;
+
+    // same geometry and more data: the columns drawn are final but the last
+    same = frame->start == mWaveDrawn.start && frame->span == mWaveDrawn.span &&
+        frame->ncols == mWaveDrawn.ncols && frame->valid >= mWaveDrawn.valid;
+    if (same && frame->valid == 0)
+        return;
+    if (same)
+        first = mWaveDrawn.valid ? mWaveDrawn.valid - 1 : 0;
+
+    cr = cairo_create(mWaveSurface);
+    cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+    cairo_rectangle(cr, first, 0, width - first, height);
+    cairo_fill(cr);
+    cairo_set_source_rgb(cr, 0.2, 0.9, 0.3);
+    for (x = first; x < frame->valid; x++) {
+        for (c = 0; c < LA_NB_CHANNELS; c++) {
+            high = floor(c * band + 3);
+            low = floor((c + 1) * band - 4);
+            state = (frame->cell[x] >> (2 * c)) & 3;
+            prev = x ? (frame->cell[x - 1] >> (2 * c)) & 3 : state;
+            if (state == 3 || (prev | state) == 3)
+                cairo_rectangle(cr, x, high, 1, low - high + 1);
+            else if (state == 2)
+                cairo_rectangle(cr, x, high, 1, 1);
+            else if (state == 1)
+                cairo_rectangle(cr, x, low, 1, 1);
+        }
+    }
+    cairo_fill(cr);
+    cairo_destroy(cr);
+    gtk_widget_queue_draw_area(wave_area, first, 0, width - first, height);
+
+    mWaveDrawn.start = frame->start;
+    mWaveDrawn.span = frame->span;
+    mWaveDrawn.ncols = frame->ncols;
+    mWaveDrawn.valid = frame->valid;
+    // follow mode moved the viewport, start from there when panning
+    if (mWaveView.follow)
+        mWaveView.start = frame->start;
+}
+
+static gboolean wave_tick_CB (gpointer data)
+{
+    const la_wave_frame *frame = la_wave_acquire(&mWave);
+
+    if (frame && mWaveSurface)
+        wave_paint(frame);
+    return TRUE;
+}
+
+static gboolean wave_draw_CB (GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    if (mWaveSurface) {
+        cairo_set_source_surface(cr, mWaveSurface, 0, 0);
+        cairo_paint(cr);
+    }
+    return FALSE;
+}
+
+static gboolean wave_configure_CB (GtkWidget *widget, GdkEventConfigure *event, gpointer data)
+{
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+
+    if (mWaveSurface)
+        cairo_surface_destroy(mWaveSurface);
+    mWaveSurface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    memset(&mWaveDrawn, 0, sizeof(mWaveDrawn));
+    mWaveDrawn.ncols = UINT32_MAX;
+    mWaveView.ncols = width < LA_WAVE_MAX_COLS ? width : LA_WAVE_MAX_COLS;
+    wave_view_changed();
+    return TRUE;
+}
+
+// wheel: zoom around the pointer, by powers of 2 to stay on pyramid levels
+static gboolean wave_scroll_CB (GtkWidget *widget, GdkEventScroll *event, gpointer data)
+{
+    uint64_t at = mWaveView.start + (uint64_t)event->x * mWaveView.span;
+    uint64_t left;
+
+    if (event->direction == GDK_SCROLL_UP && mWaveView.span > 1)
+        mWaveView.span /= 2;
+    else if (event->direction == GDK_SCROLL_DOWN && mWaveView.span < (1ULL << 40))
+        mWaveView.span *= 2;
+    else
+        return FALSE;
+    left = (uint64_t)event->x * mWaveView.span;
+    mWaveView.start = at > left ? at - left : 0;
+    wave_view_changed();
+    return TRUE;
+}
+
+// drag: pan, which leaves follow mode
+static gboolean wave_press_CB (GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+    mWaveDragX = event->x;
+    mWaveDragStart = mWaveView.start;
+    return TRUE;
+}
+
+static gboolean wave_motion_CB (GtkWidget *widget, GdkEventMotion *event, gpointer data)
+{
+    int64_t shift = (int64_t)(mWaveDragX - event->x) * (int64_t)mWaveView.span;
+
+    if (shift < 0 && (uint64_t)-shift >= mWaveDragStart)
+        mWaveView.start = 0;
+    else
+        mWaveView.start = mWaveDragStart + shift;
+    if (mWaveView.follow)
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(notchFollow), FALSE);
+    wave_view_changed();
+    return TRUE;
+}
+
+static void follow_toggled (GtkToggleButton *button, gpointer data)
+{
+    mWaveView.follow = gtk_toggle_button_get_active(button);
+    wave_view_changed();
+}
+
 void *ui_thread(void *arg)
 {
    
     GtkWidget *mainGrid;
     char tmpStr[100];
+    const char *hzStr;
+    int uiHz;
    
     time_t t = time(NULL);
     struct tm tm = *localtime(&t);
@@ -593,11 +988,53 @@ void *ui_thread(void *arg)
     data_value = gtk_label_new ("");
     gtk_label_set_xalign (GTK_LABEL (data_value), 0);
     gtk_widget_set_name(data_value, "value");
+
+    record_label = gtk_label_new ("Recording :");
+    gtk_label_set_xalign (GTK_LABEL (record_label), 0);
+    gtk_widget_set_name(record_label, "header");
+
+    record_value = gtk_label_new ("off");
+    gtk_label_set_xalign (GTK_LABEL (record_value), 0);
+    gtk_widget_set_name(record_value, "value");
+
+    samples_label = gtk_label_new ("Decoded samples :");
+    gtk_label_set_xalign (GTK_LABEL (samples_label), 0);
+    gtk_widget_set_name(samples_label, "header");
+
+    samples_value = gtk_label_new ("");
+    gtk_label_set_xalign (GTK_LABEL (samples_value), 0);
+    gtk_widget_set_name(samples_value, "value");
+
+    channels_label = gtk_label_new ("Channels high :");
+    gtk_label_set_xalign (GTK_LABEL (channels_label), 0);
+    gtk_widget_set_name(channels_label, "header");
+
+    channels_value = gtk_label_new ("");
+    gtk_label_set_xalign (GTK_LABEL (channels_value), 0);
+    gtk_widget_set_name(channels_value, "value");
+
+    wave_label = gtk_label_new ("Waveform PE8..PE12 :");
+    gtk_label_set_xalign (GTK_LABEL (wave_label), 0);
+    gtk_widget_set_name(wave_label, "header");
+
+    notchFollow = gtk_check_button_new_with_label("Follow");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(notchFollow), mWaveView.follow);
+    g_signal_connect(notchFollow, "toggled", G_CALLBACK (follow_toggled), NULL);
+
+    wave_area = gtk_drawing_area_new ();
+    gtk_widget_set_hexpand (wave_area, TRUE);
+    gtk_widget_set_vexpand (wave_area, TRUE);
+    gtk_widget_add_events (wave_area, GDK_SCROLL_MASK | GDK_BUTTON_PRESS_MASK | GDK_BUTTON1_MOTION_MASK);
+    g_signal_connect (wave_area, "draw", G_CALLBACK (wave_draw_CB), NULL);
+    g_signal_connect (wave_area, "configure-event", G_CALLBACK (wave_configure_CB), NULL);
+    g_signal_connect (wave_area, "scroll-event", G_CALLBACK (wave_scroll_CB), NULL);
+    g_signal_connect (wave_area, "button-press-event", G_CALLBACK (wave_press_CB), NULL);
+    g_signal_connect (wave_area, "motion-notify-event", G_CALLBACK (wave_motion_CB), NULL);
    
-    gtk_label_set_text (GTK_LABEL (state_value), machine_state_str[mMachineState]);
-    sprintf(tmpStr, "%u", mNbUncompData);
+    gtk_label_set_text (GTK_LABEL (state_value), machine_state_str[SHARED_GET(mMachineState)]);
+    sprintf(tmpStr, "%u", SHARED_GET(mNbUncompData));
     gtk_label_set_text (GTK_LABEL (nbCompData_value), tmpStr);
-    sprintf(tmpStr, "%u", mNbUncompData);
+    sprintf(tmpStr, "%u", SHARED_GET(mNbUncompData));
     gtk_label_set_text (GTK_LABEL (nbRealData_value), tmpStr);
     sprintf(tmpStr, "%u", mNbWrittenInFileData);
     gtk_label_set_text (GTK_LABEL (nbRpmsgFrame_value), tmpStr);
@@ -614,6 +1051,9 @@ void *ui_thread(void *arg)
     notchSetdata = gtk_check_button_new_with_label("Set DATA");
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(notchSetdata), FALSE);
 
+    notchRecord = gtk_check_button_new_with_label("Record");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(notchRecord), FALSE);
+
                    
     mainGrid = gtk_grid_new ();
     gtk_grid_set_row_spacing (GTK_GRID (mainGrid), 5);
@@ -632,6 +1072,8 @@ void *ui_thread(void *arg)
    
     // SetDATA notch in (3,2) is 2 column large & 2 row high
     gtk_grid_attach (GTK_GRID (mainGrid), notchSetdata, 2, 2, 2, 1);
+    // Record notch in (2,3) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), notchRecord, 2, 3, 2, 1);
    
     // Measurement title in (0,4) is 3 columns large & 1 row high
     gtk_grid_attach (GTK_GRID (mainGrid), measurTitle_label, 0, 4, 3, 1);
@@ -656,20 +1098,55 @@ void *ui_thread(void *arg)
     // File name value in (2,9) is 2 column large & 1 row high
     gtk_grid_attach (GTK_GRID (mainGrid), data_value, 2, 8, 2, 1);
 
+    // Recording label in (0,9) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), record_label, 0, 9, 2, 1);
+    // Recording value in (2,9) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), record_value, 2, 9, 2, 1);
+
+    // Decoded samples label in (0,10) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), samples_label, 0, 10, 2, 1);
+    // Decoded samples value in (2,10) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), samples_value, 2, 10, 2, 1);
+
+    // Channels label in (0,11) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), channels_label, 0, 11, 2, 1);
+    // Channels value in (2,11) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), channels_value, 2, 11, 2, 1);
+
+    // Waveform label in (0,12) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), wave_label, 0, 12, 2, 1);
+    // Follow notch in (2,12) is 2 column large & 1 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), notchFollow, 2, 12, 2, 1);
+    // Waveform in (0,13) is 4 column large & 6 row high
+    gtk_grid_attach (GTK_GRID (mainGrid), wave_area, 0, 13, 4, 6);
+
     gtk_grid_set_row_homogeneous (GTK_GRID (mainGrid), TRUE);
    
     gtk_container_add (GTK_CONTAINER (window), mainGrid);
  
     gtk_widget_show_all(window);
+    g_timeout_add (WAVE_PERIOD_MS, wave_tick_CB, NULL);
+    // shown as they are now, the first refresh only sets what differs
+    ui_snapshot_take(&mUiShown);
+    mUiShown.state = -1;
+    hzStr = getenv("LA_UI_HZ");
+    uiHz = hzStr ? atoi(hzStr) : UI_REFRESH_HZ;
+    if (uiHz <= 0 || uiHz > 1000)
+        uiHz = UI_REFRESH_HZ;
+    g_timeout_add (1000 / uiHz, refreshUI_CB, NULL);
    
  
     gtk_main ();
+    // window closed: let the event loop terminate
+    SHARED_SET(mThreadCancel, 1);
+    event_loop_notify();
     return 0;
 }
   
 /*************************************************************************************
 End of GTK UI functions
 *************************************************************************************/
+#endif /* LA_HEADLESS */
  
 static void sleep_ms(int milliseconds)
 {
@@ -697,17 +1174,23 @@ void incatchr(int signum){
  
 void exit_fct(int signum)
 {
-    gtk_main_quit();
-    mThreadCancel = 1;
+#ifndef LA_HEADLESS
+    if (!mHeadless)
+        gtk_main_quit();
+#endif
+    SHARED_SET(mThreadCancel, 1);
+    event_loop_notify();
     sleep_ms(100);
     if (fMappedData) {
-        for (int i=0;i<NB_BUF;i++){
-            int rc = munmap(mmappedData[i], DATA_BUF_POOL_SIZE);
-            assert(rc == 0);
-        }
+        int rc = munmap(mmappedPool, NB_BUF * DATA_BUF_POOL_SIZE);
+        assert(rc == 0);
         fMappedData = 0;
         printf("CA7 : Buffers successfully unmapped\n");
     }
+    if (mRing != NULL) {
+        munmap(mRing, mRingSize);
+        mRing = NULL;
+    }
  
     if (copro_isFwRunning()) {
         mExitRequested = 1;
@@ -719,20 +1202,11 @@ void exit_fct(int signum)
         copro_stopFw();
         printf("CA7 : stop the firmware before exit\n");
     }
-#if 0
-    if (pOutFile != NULL) {
-        printf("CA7 : closing file before exit\n");
-        close_raw_file();
-    }
-#endif
     exit(signum);
 }
  
-void *virtual_tty_thread(void *arg)
+int virtual_tty_open(void)
 {
-    int read0, read1;
-    int32_t wsize;
-    int nb2copy = 0;
     char cmdmsg[20];
 
     // open tty0
@@ -747,7 +1221,7 @@ void *virtual_tty_thread(void *arg)
  
     // open tty1
     if (copro_openTtyRpmsg(1, 1)) {
-        printf("CA7 : fails to open the ttyRPMSG0\n");
+        printf("CA7 : fails to open the ttyRPMSG1\n");
         return (errno * -1);
     }
     // needed to allow M4 to send any data over virtualTTY
@@ -756,198 +1230,1026 @@ void *virtual_tty_thread(void *arg)
     usleep(500000);
     sprintf(cmdmsg, "B%02d", NB_BUF);
     copro_writeTtyRpmsg(0, strlen(cmdmsg), cmdmsg);
- 
+    return 0;
+}
+
+// open a read-only session on the SDB device that gets the completions in its
+// own ring, for the writer to splice them into the file
+static int sdb_attach_reader(void)
+{
+    rpmsg_sdb_ioctl_setup_ring q_setup_ring;
+    rpmsg_sdb_ioctl_attach q_attach;
+    int fd, efd, ret;
+
+    fd = open("/dev/rpmsg-sdb0", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return (errno * -1);
+    // nobody waits on this ring, the writer only splices what the event loop saw
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        ret = (errno * -1);
+        close(fd);
+        return ret;
+    }
+    q_setup_ring.entries = RING_ENTRIES;
+    q_setup_ring.eventfd = efd;
+    ret = ioctl(fd, RPMSG_SDB_IOCTL_SETUP_RING, &q_setup_ring);
+    if (ret == 0)
+        ret = ioctl(fd, RPMSG_SDB_IOCTL_ATTACH, &q_attach);
+    if (ret < 0)
+        ret = (errno * -1);
+    close(efd);
+    if (ret == 0 && !(q_attach.flags & RPMSG_SDB_POOL_CACHED))
+        ret = -EINVAL;
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+// name the capture after the current time and hand it over to the writer stage
+static void record_start(void)
+{
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+    int fd;
+
+    sprintf(mFileNameStr, "/usr/local/demo/la/%04d%02d%02d-%02d%02d%02d.dat",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    // attached before the M4 is started, the reader ring sees every completion
+    // the event loop sees from now on
+    fd = sdb_attach_reader();
+    if (fd < 0)
+        printf("CA7 : sdb => can't splice the buffers (err=%d), recording copies\n", fd);
+    mRecordSplice = fd >= 0;
+    if (la_writer_open(mFileNameStr, fd) < 0) {
+        mRecordSplice = 0;
+        printf("CA7 : recording disabled for this capture\n");
+    }
+}
+
+// feed the writer stage, the data is copied so the caller can recycle it at once
+static void record_data(const void *data, uint32_t size)
+{
+    int ret;
+
+    if (!la_writer_is_open())
+        return;
+    ret = la_writer_submit(data, size);
+    if (ret == -EIO) {
+        la_writer_close();
+        capture_stop("Recording failed => Stop sampling!!!");
+    } else if (ret == -ENOSPC) {
+        printf("CA7 : writer => backlog full, %u bytes dropped\n", size);
+    }
+}
+
+// queue a completion of the SDB ring for the writer, in ring order
+static void record_completion(const rpmsg_sdb_ring_entry *entry)
+{
+    int ret;
+
+    if (!mRecordSplice || !la_writer_is_open() || !entry->size)
+        return;
+    ret = la_writer_splice_next(entry->size);
+    if (ret == -EIO) {
+        la_writer_close();
+        capture_stop("Recording failed => Stop sampling!!!");
+    } else if (ret == -ENOSPC) {
+        // the rest of the file would be out of step with the reader ring
+        la_writer_close();
+        printf("CA7 : writer => backlog full, recording stopped\n");
+    }
+}
+
+// decoded samples come out here in capture order, whatever path they took
+static void analysis_samples(const uint8_t *samples, uint32_t count)
+{
+    uint32_t n, i;
+    int c, truncated = mIndex.truncated, pyrTruncated = mPyramid.truncated;
+
+    if (count == 0)
+        return;
+    SHARED_SET(mLastSample, samples[count - 1]);
+    // from here on everything works on one bit per sample and channel
+    n = la_transpose_run(&mTransposer, samples, count, mPlanes, 0);
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        uint64_t high = 0;
+        for (i = 0; i < n; i++)
+            high += __builtin_popcount(mPlanes[c][i]);
+        SHARED_SET(mChannelHigh[c], mChannelHigh[c] + high);
+    }
+    SHARED_SET(mNbPlaneSamples, mNbPlaneSamples + n * 8);
+    // transitions positions, for seeking and edge navigation
+    la_index_add(&mIndex, mPlanes, n);
+    for (c = 0; c < LA_NB_CHANNELS; c++)
+        SHARED_SET(mChannelEdges[c], la_index_transitions(&mIndex, c));
+    if (mIndex.truncated && !truncated)
+        printf("CA7 : index => %u MB used, transitions after sample %llu not indexed\n",
+            ANA_INDEX_MAX_BYTES / (1024*1024), (unsigned long long)mIndex.complete);
+    // and the summary the waveform is drawn from
+    la_pyramid_add(&mPyramid, mPlanes, n);
+    if (mPyramid.truncated && !pyrTruncated)
+        printf("CA7 : pyramid => %u MB used, samples after %llu not summarised\n",
+            ANA_PYRAMID_MAX_BYTES / (1024*1024), (unsigned long long)mPyramid.samples);
+}
+
+static uint64_t analysis_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// render the waveform when the UI moved it, or at most every WAVE_PERIOD_MS
+// while new samples come into view
+static void analysis_wave(void)
+{
+    uint64_t now;
+    int viewChanged;
+
+    mWaveDueMs = 0;
+    if (!la_wave_pending(&mWave, &viewChanged, &mIndex, &mPyramid))
+        return;
+    now = analysis_now_ms();
+    if (!viewChanged && now < mWaveLastMs + WAVE_PERIOD_MS) {
+        mWaveDueMs = mWaveLastMs + WAVE_PERIOD_MS;
+        return;
+    }
+    la_wave_render(&mWave, &mIndex, &mPyramid);
+    mWaveLastMs = now;
+}
+
+// sleep until there is work, or until the waveform refresh is due
+static void analysis_wait(void)
+{
+    struct timespec ts;
+    uint64_t now, ms;
+
+    if (!mWaveDueMs) {
+        while (sem_wait(&mAnaSem) < 0 && errno == EINTR)
+            ;
+        return;
+    }
+    now = analysis_now_ms();
+    if (now >= mWaveDueMs)
+        return;
+    ms = mWaveDueMs - now;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(&mAnaSem, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * The analysis thread expands the compressed data. It gets the descriptors
+ * from the event loop through mAnaQueue and gives them back through mAnaDone
+ * once the data is not needed any more, the event loop then recycles the SDB
+ * buffer or the tty ring space. It also renders the waveform frames, the UI
+ * only draws them.
+ */
+void *analysis_thread(void *arg)
+{
+    la_desc desc;
+    const uint8_t *in;
+    uint32_t len, used, n;
+    uint64_t one = 1;
+    int c;
+
     while (1) {
-        if (mThreadCancel) break;    // kill thread requested
-
-        // tty0 is used for low rate compressed data transfer (less or equal to 5MHz sampling)
-        read0 = copro_readTtyRpmsg(0, SAMP_SRAM_PACKET_SIZE, mByteBuffer);
-        if (read0 > 0) {
-            mNbTty0Frame++;
-            mNbUncompData += read0;
-
-            mNbUncompMB = mNbUncompData / 1024 / 1024;
-            if (mNbUncompMB != mNbPrevUncompMB) {
-                // a new MB has been received, update display
-                mNbPrevUncompMB = mNbUncompMB;
-                mByteBuffCpy[0] = mByteBuffer[0];
-                gdk_threads_add_idle (refreshUI_CB, window);
+        analysis_wait();
+        if (la_spsc_pop(&mAnaQueue, &desc) < 0) {
+            if (SHARED_GET(mThreadCancel))
+                break;
+            // woken up by the UI or for the waveform refresh
+            analysis_wave();
+            continue;
+        }
+        if (desc.type == LA_DESC_RESET) {
+            la_decoder_init(&mDecoder);
+            la_transposer_init(&mTransposer);
+            la_index_free(&mIndex);
+            la_pyramid_free(&mPyramid);
+            for (c = 0; c < LA_NB_CHANNELS; c++) {
+                SHARED_SET(mChannelHigh[c], 0);
+                SHARED_SET(mChannelEdges[c], 0);
             }
+            SHARED_SET(mNbPlaneSamples, 0);
+            SHARED_SET(mNbLateSamples, 0);
+        } else {
+            in = desc.data;
+            len = desc.size;
+            do {
+                n = la_decoder_run(&mDecoder, in, len, &used, mSamples, ANA_OUT_SAMPLES);
+                in += used;
+                len -= used;
+                analysis_samples(mSamples, n);
+            } while (len || mDecoder.pending);
+            if (desc.flags & LA_DESC_F_LATE)
+                SHARED_SET(mNbLateSamples, mNbLateSamples + mDecoder.samples - mNbSamples);
         }
+        SHARED_SET(mNbSamples, mDecoder.samples);
+        la_spsc_push(&mAnaDone, &desc);
+        write(mAnaEfd, &one, sizeof(one));
+        analysis_wave();
+    }
+    return 0;
+}
 
-        // tty1 is dedicated to trace of M4
-        read1 = copro_readTtyRpmsg(1, 512, mRxTraceBuffer);
-        mRxTraceBuffer[read1] = 0;  // to be sure to get a end of string
-        if (read1 > 0) {
-            if (strcmp(mRxTraceBuffer, "CM4 : DMA TransferError") == 0) {
-                // sampling is aborted, refresh the UI
-                mErrorDetected = 1;
-                //mMachineState = STATE_READY;
-                //gdk_threads_add_idle (refreshUI_CB, window);
-            }
-            gettimeofday(&tval_after, NULL);
-            timersub(&tval_after, &tval_before, &tval_result);
-            if (mRxTraceBuffer[0] == 'C') {
-                printf("[%ld.%06ld] : %s\n",
-                    (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, 
-                    mRxTraceBuffer);
-            } else {
-                printf("[%ld.%06ld] : CA7 : tty1 got %d [%x] bytes\n",
-                    (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, 
-                    read1, mRxTraceBuffer[0]);
+// returns -1 if the analysis can't take the data, the caller recycles it itself
+static int analysis_submit(uint32_t type, uint32_t id, const void *data, uint32_t size,
+    uint32_t flags)
+{
+    la_desc desc;
+
+    if (!mAnaRunning || mAnaInFlight >= ANA_QUEUE_ENTRIES)
+        return -1;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = type;
+    desc.id = id;
+    desc.data = data;
+    desc.size = size;
+    desc.flags = flags;
+    la_spsc_push(&mAnaQueue, &desc);
+    mAnaInFlight++;
+    sem_post(&mAnaSem);
+    return 0;
+}
+
+int analysis_init(void)
+{
+    la_spsc_init(&mAnaQueue, mAnaQueueSlot, ANA_QUEUE_ENTRIES);
+    la_spsc_init(&mAnaDone, mAnaDoneSlot, ANA_QUEUE_ENTRIES);
+    la_decoder_init(&mDecoder);
+    la_transposer_init(&mTransposer);
+    la_index_init(&mIndex, ANA_INDEX_MAX_BYTES);
+    la_pyramid_init(&mPyramid, ANA_PYRAMID_MAX_BYTES);
+    // a page of 1024 samples per pixel, following the capture, drawn once
+    // the UI gives the number of columns
+    mWaveView.span = LA_PYRAMID_BASE;
+    mWaveView.follow = 1;
+    la_wave_init(&mWave, &mWaveView);
+    mAnaEfd = eventfd(0, EFD_NONBLOCK);
+    if (mAnaEfd == -1 || sem_init(&mAnaSem, 0, 0) < 0) {
+        printf("CA7 : Error creating the analysis stage, err=-%d\n", errno);
+        return (errno * -1);
+    }
+    if (pthread_create( &threadAnalysis, NULL, analysis_thread, NULL) != 0) {
+        printf("CA7 : analysis_thread creation fails\n");
+        return -1;
+    }
+    mAnaRunning = 1;
+    return 0;
+}
+
+// account for the tty0 data gathered in the ring since the last call
+static void virtual_tty_consume(void)
+{
+    uint32_t head = mTtyRingHead;
+    uint32_t len = head - mTtyRingSeen;
+    uint32_t off = mTtyRingSeen & (TTY_RING_SIZE - 1);
+
+    if (len == 0)
+        return;
+    // frames are counted in M4 packet units since reads are batched
+    SHARED_SET(mNbTty0Frame, mNbTty0Frame + (len + SAMP_SRAM_PACKET_SIZE - 1) / SAMP_SRAM_PACKET_SIZE);
+    SHARED_SET(mNbUncompData, mNbUncompData + len);
+    if (off + len > TTY_RING_SIZE) {
+        record_data(&mTtyRing[off], TTY_RING_SIZE - off);
+        record_data(mTtyRing, len - (TTY_RING_SIZE - off));
+    } else {
+        record_data(&mTtyRing[off], len);
+    }
+
+    SHARED_SET(mNbUncompMB, mNbUncompData / 1024 / 1024);
+    if (mNbUncompMB != mNbPrevUncompMB) {
+        // a new MB has been received, sample its first byte for the display
+        mNbPrevUncompMB = mNbUncompMB;
+        SHARED_SET(mFirstByte, mTtyRing[off]);
+    }
+    mTtyRingSeen = head;
+}
+
+// hand the tty0 data over to the analysis, it stays in the ring until analysed
+static void virtual_tty_analyse(void)
+{
+    uint32_t off, len;
+
+    while (mTtyRingSubmitted != mTtyRingSeen) {
+        off = mTtyRingSubmitted & (TTY_RING_SIZE - 1);
+        len = mTtyRingSeen - mTtyRingSubmitted;
+        if (off + len > TTY_RING_SIZE)
+            len = TTY_RING_SIZE - off;
+        if (analysis_submit(LA_DESC_TTY, 0, &mTtyRing[off], len, 0) < 0) {
+            if (!mAnaRunning) {
+                // no analysis stage, the data is not needed any more
+                mTtyRingSubmitted = mTtyRingTail = mTtyRingSeen;
             }
+            break;
+        }
+        mTtyRingSubmitted += len;
+    }
+}
+
+// tty0 is used for low rate compressed data transfer (less or equal to 5MHz sampling)
+static void virtual_tty_rx_data(void)
+{
+    struct iovec iov[2];
+    uint32_t head, space, off;
+    int iovcnt, read0;
+
+    // fill all the free space of the ring with a single readv, the tty hands out
+    // as many queued vring messages as fit instead of one 512 bytes packet per call
+    do {
+        head = mTtyRingHead;
+        space = TTY_RING_SIZE - (head - mTtyRingTail);
+        if (space == 0) {
+            // the analysis is late: stop watching tty0 until it frees some space,
+            // the data waits in the vring meanwhile
+            event_loop_watch(mFdRpmsg[0], 0);
+            mTty0Paused = 1;
+            break;
         }
-        //usleep(500);
+        off = head & (TTY_RING_SIZE - 1);
+        iov[0].iov_base = &mTtyRing[off];
+        if (off + space <= TTY_RING_SIZE) {
+            iov[0].iov_len = space;
+            iovcnt = 1;
+        } else {
+            iov[0].iov_len = TTY_RING_SIZE - off;
+            iov[1].iov_base = mTtyRing;
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        read0 = copro_readvTtyRpmsg(0, iov, iovcnt);
+        if (read0 <= 0)
+            break;
+        mTtyRingHead = head + read0;
+        virtual_tty_consume();
+        virtual_tty_analyse();
+    } while ((uint32_t)read0 == space);   // ring was too small, more data may be pending
+}
+
+// tty1 is dedicated to trace of M4
+static void virtual_tty_rx_trace(void)
+{
+    int read1;
 
-        //sleep_ms(1);      // give time to UI
+    read1 = copro_readTtyRpmsg(1, sizeof(mRxTraceBuffer) - 1, mRxTraceBuffer);
+    if (read1 <= 0)
+        return;
+    mRxTraceBuffer[read1] = 0;  // to be sure to get a end of string
+    if (strcmp(mRxTraceBuffer, "CM4 : DMA TransferError") == 0) {
+        // sampling is aborted, refresh the UI
+        capture_stop("M4 reported DMA error !!!");
+    }
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    if (mRxTraceBuffer[0] == 'C') {
+        printf("[%ld.%06ld] : %s\n",
+            (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, 
+            mRxTraceBuffer);
+    } else {
+        printf("[%ld.%06ld] : CA7 : tty1 got %d [%x] bytes\n",
+            (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, 
+            read1, mRxTraceBuffer[0]);
     }
-    return 0;
 }
  
-void *sdb_thread(void *arg)
-{
-    int ret, rc, i, n;
-    int buffIdx = 0;
-    char buf[16];
-    char dbgmsg[80];
-    rpmsg_sdb_ioctl_get_data_size q_get_data_size;
-    char *filename = "/dev/rpmsg-sdb";
-    rpmsg_sdb_ioctl_set_efd q_set_efd;
+// buffers are mapped cacheable, CPU accesses must be bracketed by these syncs
+static void sdb_cpu_access(int bufferId, int begin)
+{
+    rpmsg_sdb_ioctl_cpu_access q_cpu_access;
+
+    q_cpu_access.bufferId = bufferId;
+    if (ioctl(mFdSdbRpmsg, begin ? RPMSG_SDB_IOCTL_BEGIN_CPU_ACCESS : RPMSG_SDB_IOCTL_END_CPU_ACCESS,
+            &q_cpu_access) < 0) {
+        error(EXIT_FAILURE, errno, "Failed to sync buffer for cpu access");
+    }
+}
+
+// hand the buffer back to the copro once it is consumed
+static void sdb_release_buffer(int bufferId)
+{
+    rpmsg_sdb_ioctl_release_buffer q_release_buffer;
+
+    q_release_buffer.bufferId = bufferId;
+    if (ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_RELEASE_BUFFER, &q_release_buffer) < 0) {
+        printf("CA7 : sdb => failed to release buf[%d]\n", bufferId);
+    }
+}
+
+// flags: LA_DESC_F_LATE if the data comes after data captured later
+static void sdb_process_buffer(rpmsg_sdb_ring_entry *entry, uint32_t flags)
+{
+    int analysed = 0;
+
+    if (entry->flags & RPMSG_SDB_RING_F_OVERRUN) {
+        mNbOverruns++;
+        printf("CA7 : sdb => buf[%u] overwritten before release, %u overruns\n",
+            entry->buffer_id, mNbOverruns);
+    }
+    if (entry->size) {
+        SHARED_SET(mNbUncompMB, mNbUncompMB + 1);
+        SHARED_SET(mNbUncompData, mNbUncompData + entry->size);
+        unsigned char* pData = (unsigned char*)mmappedData[entry->buffer_id];
+        sdb_cpu_access(entry->buffer_id, 1);
+        // save a copy of 1st data
+        SHARED_SET(mFirstByte, *pData);
+        if (!mRecordSplice)
+            record_data(pData, entry->size);
+        // the CPU access stays open while the analysis reads the buffer, it is
+        // ended when the buffer comes back (event_loop_analysis_done)
+        analysed = analysis_submit(LA_DESC_SDB, entry->buffer_id, pData, entry->size, flags) == 0;
+        if (!analysed)
+            sdb_cpu_access(entry->buffer_id, 0);
+        gettimeofday(&tval_after, NULL);
+        timersub(&tval_after, &tval_before, &tval_result);
+            printf("[%ld.%06ld] sdb data EVENT buffer=%u mNbUncompData=%u \n", 
+                (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, entry->buffer_id, 
+                mNbUncompData);
+    }
+    else {
+        printf("CA7 : sdb => buf[%u] is empty\n", entry->buffer_id);
+    }
+    if (!analysed)
+        sdb_release_buffer(entry->buffer_id);
+}
+
+// hand over all the parked completions that follow the next expected one
+static void sdb_reorder_flush(void)
+{
+    while (mReorderValid[mSeqNext % NB_BUF]) {
+        mReorderValid[mSeqNext % NB_BUF] = 0;
+        mReorderPending--;
+        sdb_process_buffer(&mReorder[mSeqNext % NB_BUF], 0);
+        mSeqNext++;
+    }
+}
+
+// give up waiting for the next expected completion
+static void sdb_reorder_skip(void)
+{
+    mNbSkipped++;
+    printf("CA7 : sdb => seq %u missing, skipped (%u skipped so far)\n", mSeqNext, mNbSkipped);
+    mSeqNext++;
+    sdb_reorder_flush();
+}
+
+static void sdb_reorder_reset(void)
+{
+    while (mReorderPending)
+        sdb_reorder_skip();
+    mSeqStarted = 0;
+    mNbSkipped = 0;
+    mNbLate = 0;
+}
+
+/*
+ * Completions are processed in sequence number order, whatever the buffer
+ * they use. One that arrives ahead of time is parked until the ones before
+ * it show up, a missing one is skipped once the window is full, and one that
+ * shows up after being skipped is processed at once, marked late: its data is
+ * recorded and analysed after data captured later, and counted in the late
+ * samples of the status.
+ *
+ * Only the binary protocol carries the M4 sequence numbers. With legacy
+ * firmware the driver numbers the completions as they arrive, so nothing is
+ * ever parked or late and the data keeps the arrival order.
+ */
+static void sdb_reorder(rpmsg_sdb_ring_entry *entry)
+{
+    uint32_t slot = entry->seq % NB_BUF;
+
+    if (entry->buffer_id >= NB_BUF) {
+        printf("CA7 : sdb => unknown buf[%u]\n", entry->buffer_id);
+        return;
+    }
+    if (!mSeqStarted) {
+        mSeqNext = entry->seq;
+        mSeqStarted = 1;
+    }
+    if ((int32_t)(entry->seq - mSeqNext) < 0 || mReorderValid[slot]) {
+        mNbLate++;
+        printf("CA7 : sdb => buf[%u] seq %u late, expecting %u (%u late so far)\n",
+            entry->buffer_id, entry->seq, mSeqNext, mNbLate);
+        sdb_process_buffer(entry, LA_DESC_F_LATE);
+        return;
+    }
+    while ((int32_t)(entry->seq - mSeqNext) >= REORDER_WINDOW)
+        sdb_reorder_skip();
+    mReorder[slot] = *entry;
+    mReorderValid[slot] = 1;
+    mReorderPending++;
+    sdb_reorder_flush();
+    // the M4 can't complete anything else before we release a buffer
+    if (mReorderPending >= REORDER_WINDOW)
+        sdb_reorder_skip();
+}
+
+int sdb_open(void)
+{
+    int i;
+    char *filename = "/dev/rpmsg-sdb0";
+    rpmsg_sdb_ioctl_setup_ring q_setup_ring;
+    rpmsg_sdb_ioctl_alloc_pool q_alloc_pool;
  
     mFdSdbRpmsg = open(filename, O_RDWR);
     assert(mFdSdbRpmsg != -1);
+
+    // Completions are read from a ring shared with the kernel driver, the eventfd
+    // is only used to wake the event loop up when the ring gets filled
+    mRingEfd = eventfd(0, EFD_NONBLOCK);
+    if (mRingEfd == -1)
+        error(EXIT_FAILURE, errno,
+            "failed to get eventfd");
+    q_setup_ring.entries = RING_ENTRIES;
+    q_setup_ring.eventfd = mRingEfd;
+    if(ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_SETUP_RING, &q_setup_ring) < 0)
+        error(EXIT_FAILURE, errno,
+            "failed to setup the completion ring");
+    mRingSize = sizeof(rpmsg_sdb_ring) + RING_ENTRIES * sizeof(rpmsg_sdb_ring_entry);
+    mRing = mmap(NULL,
+                    mRingSize,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    mFdSdbRpmsg,
+                    RPMSG_SDB_RING_MMAP_OFFSET);
+    assert(mRing != MAP_FAILED);
+
+    // All the buffers come from a single pool, announced at once to the M4 and
+    // mapped cacheable (much faster to read than the default uncached mapping)
+    q_alloc_pool.count = NB_BUF;
+    q_alloc_pool.size = DATA_BUF_POOL_SIZE;
+    q_alloc_pool.flags = RPMSG_SDB_POOL_CACHED;
+    if(ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_ALLOC_POOL, &q_alloc_pool) < 0)
+        error(EXIT_FAILURE, errno,
+            "failed to allocate the buffer pool");
+    assert(q_alloc_pool.size == DATA_BUF_POOL_SIZE);
+    mmappedPool = mmap(NULL,
+                        NB_BUF * DATA_BUF_POOL_SIZE,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED,
+                        mFdSdbRpmsg,
+                        RPMSG_SDB_POOL_MMAP_OFFSET);
+    assert(mmappedPool != MAP_FAILED);
     for (i=0;i<NB_BUF;i++){
-        // Create the evenfd, and sent it to kernel driver, for notification of buffer full
-        efd[i] = eventfd(0, 0);
-        if (efd[i] == -1)
-            error(EXIT_FAILURE, errno,
-                "failed to get eventfd");
-        printf("\nCA7 : Forward efd info for buf%d with mFdSdbRpmsg:%d and efd:%d\n",i,mFdSdbRpmsg,efd[i]);
-        q_set_efd.bufferId = i;
-        q_set_efd.eventfd = efd[i];
-        if(ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_SET_EFD, &q_set_efd) < 0)
-            error(EXIT_FAILURE, errno,
-                "failed to set efd");
-        // watch eventfd for input
-        fds[i].fd = efd[i];
-        fds[i].events = POLLIN;
-        mmappedData[i] = mmap(NULL,
-                                DATA_BUF_POOL_SIZE,
-                                PROT_READ | PROT_WRITE,
-                                MAP_PRIVATE,
-                                mFdSdbRpmsg,
-                                0);
-        printf("\nCA7 : DBG mmappedData[%d]:%p\n", i, mmappedData[i]);
-        assert(mmappedData[i] != MAP_FAILED);
-        fMappedData = 1;
-        sleep_ms(50);
+        mmappedData[i] = (char *)mmappedPool + i * DATA_BUF_POOL_SIZE;
+        printf("CA7 : DBG mmappedData[%d]:%p\n", i, mmappedData[i]);
     }
+    fMappedData = 1;
+    return 0;
+}
 
-    while (1) {
-        if (mMachineState == STATE_SAMPLING_HIGH) {
-            // wait till at least one buffer becomes available
-            ret = poll(fds, NB_BUF, TIMEOUT * 1000);
-            if (ret == -1)
-                perror("poll()");
-            else if (ret == 0){
-                printf("CA7 : No buffer data within %d seconds.\n", TIMEOUT);
-            }
-            if (fds[mDdrBuffAwaited].revents & POLLIN) {
-                rc = read(efd[mDdrBuffAwaited], buf, 16);
-                if (!rc) {
-                    printf("CA7 : stdin closed\n");
-                    return 0;
-                }
-                /* Get buffer data size*/
-                q_get_data_size.bufferId = mDdrBuffAwaited;
- 
-                if(ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_GET_DATA_SIZE, &q_get_data_size) < 0) {
-                    error(EXIT_FAILURE, errno, "Failed to get data size");
-                }
- 
-                if (q_get_data_size.size) {
-                    mNbUncompMB++;
-                    mNbUncompData += q_get_data_size.size;
-                    unsigned char* pData = (unsigned char*)mmappedData[mDdrBuffAwaited];
-                    // save a copy of 1st data
-                    mByteBuffCpy[0] = *pData;
-                    gettimeofday(&tval_after, NULL);
-                    timersub(&tval_after, &tval_before, &tval_result);
-                        printf("[%ld.%06ld] sdb_thread data EVENT mDdrBuffAwaited=%d mNbUncompData=%u \n", 
-                            (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, mDdrBuffAwaited, 
-                            mNbUncompData);
-                    gdk_threads_add_idle (refreshUI_CB, window);
-                }
-                else {
-                    printf("CA7 : sdb_thread => buf[%d] is empty\n", mDdrBuffAwaited);
-                }
-                mDdrBuffAwaited++;
-                if (mDdrBuffAwaited >= NB_BUF) {
-                    mDdrBuffAwaited = 0;
-                }
+// drain all the completions posted so far, called each time the ring eventfd fires
+static void sdb_drain_ring(void)
+{
+    uint32_t prod, cons;
+
+    cons = mRing->consumer;
+    prod = __atomic_load_n(&mRing->producer, __ATOMIC_ACQUIRE);
+    while (cons != prod) {
+        while (cons != prod) {
+            // spliced in arrival order, the order of the reader ring
+            record_completion(&mRing->entry[cons & (RING_ENTRIES - 1)]);
+            sdb_reorder(&mRing->entry[cons & (RING_ENTRIES - 1)]);
+            cons++;
+        }
+        __atomic_store_n(&mRing->consumer, cons, __ATOMIC_RELEASE);
+        // the driver signals the eventfd only if it sees our consumer index equal to its
+        // producer index, so check again after a full barrier before going back to sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        prod = __atomic_load_n(&mRing->producer, __ATOMIC_ACQUIRE);
+    }
+    if (__atomic_load_n(&mRing->dropped, __ATOMIC_RELAXED) != mRingDropped) {
+        printf("CA7 : sdb completion ring full, %u completions lost\n",
+            mRing->dropped - mRingDropped);
+        mRingDropped = mRing->dropped;
+        // the driver gave the buffers back to the M4, but their data is lost
+        capture_stop("Completion ring overflow => Stop sampling!!!");
+    }
+}
+
+static void capture_start(uint32_t freq, uint32_t flags)
+{
+    if (mMachineState != STATE_READY)
+        return;
+    if (freq > 5) {
+        SHARED_SET(mMachineState, STATE_SAMPLING_HIGH);
+    } else {
+        SHARED_SET(mMachineState, STATE_SAMPLING_LOW);
+    }
+    SHARED_SET(mNbUncompData, 0);
+    SHARED_SET(mNbUncompMB, 0);
+    SHARED_SET(mNbTty0Frame, 0);
+    mNbPrevUncompMB = 0;
+    mNbWrittenInFileData = 0;
+    // a new capture starts, sequence numbers restart from its first completion
+    sdb_reorder_reset();
+    if (analysis_submit(LA_DESC_RESET, 0, NULL, 0, 0) < 0 && mAnaRunning)
+        printf("CA7 : analysis is late, decoder not reset\n");
+    SHARED_SET(mRecordRequested, !!(flags & LA_CMD_F_RECORD));
+    if (mRecordRequested)
+        record_start();
+    // build sampling string
+    sprintf(mSamplingStr, "S%03dMs%c", freq, (flags & LA_CMD_F_SETDATA) ? 'y' : 'n');
+    printf("CA7 : Start sampling at %dMHz\n", freq);
+    virtual_tty_send_command(strlen(mSamplingStr), mSamplingStr);
+}
+
+// stop the capture on request (reason NULL) or after an M4, driver or disk error
+static void capture_stop(const char *reason)
+{
+    if (mMachineState < STATE_SAMPLING_LOW)
+        return;
+    SHARED_SET(mMachineState, STATE_READY);
+    virtual_tty_send_command(strlen("Exit"), "Exit");
+    if (reason) {
+        printf("CA7 : %s\n", reason);
+    } else {
+        printf("CA7 : Stop sampling\n");
+    }
+    if (mSeqStarted) {
+        // nothing will fill the gaps any more, hand over what is parked
+        while (mReorderPending)
+            sdb_reorder_skip();
+        printf("CA7 : sdb => capture stopped, %u completions skipped, %u late\n",
+            mNbSkipped, mNbLate);
+    }
+    la_writer_close();
+}
+
+// called on the event loop each time the control eventfd is kicked
+static void event_loop_commands(void)
+{
+    la_desc cmd;
+
+    while (la_mpmc_pop(&mCtrlQueue, &cmd) == 0) {
+        switch (cmd.type) {
+        case LA_CMD_START:
+            capture_start(cmd.id, cmd.flags);
+            break;
+        case LA_CMD_STOP:
+            capture_stop(NULL);
+            break;
+        default:
+            printf("CA7 : unknown command %u\n", cmd.type);
+            break;
+        }
+    }
+}
+
+// recycle what the analysis is done with
+static void event_loop_analysis_done(void)
+{
+    la_desc desc;
+
+    while (la_spsc_pop(&mAnaDone, &desc) == 0) {
+        mAnaInFlight--;
+        if (desc.type == LA_DESC_SDB) {
+            sdb_cpu_access(desc.id, 0);
+            sdb_release_buffer(desc.id);
+        } else if (desc.type == LA_DESC_TTY) {
+            // analysed in order, the oldest data of the ring
+            mTtyRingTail += desc.size;
+        }
+    }
+    if (mTty0Paused) {
+        mTty0Paused = 0;
+        event_loop_watch(mFdRpmsg[0], 1);
+    }
+    virtual_tty_analyse();
+}
+
+/*
+ * Control socket commands, answered by "ok", "error <reason>" or one line of
+ * values for status:
+ *   start <MHz> [record] [setdata]
+ *   stop
+ *   status
+ *   quit
+ * The commands go through mCtrlQueue like the GUI ones.
+ */
+static void ctrl_reply(ctrl_client *client, const char *fmt, ...)
+{
+    char str[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(str, sizeof(str), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(str) - 1)
+        len = sizeof(str) - 1;
+    // a client that doesn't read its answers loses them
+    if (write(client->fd, str, len) < 0 && errno != EAGAIN)
+        printf("CA7 : ctrl => reply failed, err=-%d\n", errno);
+}
+
+static void ctrl_command(ctrl_client *client, char *line)
+{
+    char *arg, *save;
+    uint32_t flags = 0;
+    la_writer_stats stats;
+    int freq;
+
+    arg = strtok_r(line, " \t\r", &save);
+    if (!arg)
+        return;
+    if (strcmp(arg, "start") == 0) {
+        arg = strtok_r(NULL, " \t\r", &save);
+        freq = arg ? atoi(arg) : 0;
+        if (freq < 1 || freq > 12) {
+            ctrl_reply(client, "error frequency must be 1..12 MHz\n");
+            return;
+        }
+        while ((arg = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            if (strcmp(arg, "record") == 0) {
+                flags |= LA_CMD_F_RECORD;
+            } else if (strcmp(arg, "setdata") == 0) {
+                flags |= LA_CMD_F_SETDATA;
             } else {
-                // we face message lost due to SDB driver not managing RPMSG DATA containing several messages
-                // in this case, just treat several message
-                mDdrBuffAwaited++;
-                if (mDdrBuffAwaited >= NB_BUF) {
-                    mDdrBuffAwaited = 0;
-                }
-                if (fds[mDdrBuffAwaited].revents & POLLIN) {
-                    rc = read(efd[mDdrBuffAwaited], buf, 16);
-                    if (!rc) {
-                        printf("CA7 : stdin closed\n");
-                        return 0;
-                    }
-                    /* Get buffer data size*/
-                    q_get_data_size.bufferId = mDdrBuffAwaited;
-     
-                    if(ioctl(mFdSdbRpmsg, RPMSG_SDB_IOCTL_GET_DATA_SIZE, &q_get_data_size) < 0) {
-                        error(EXIT_FAILURE, errno, "Failed to get data size");
-                    }
-     
-                    if (q_get_data_size.size) {
-                        mNbUncompMB += 2;
-                        mNbUncompData += q_get_data_size.size;
-                        mNbUncompData += q_get_data_size.size;    // need twice as we missed one
-                        unsigned char* pData = (unsigned char*)mmappedData[mDdrBuffAwaited];
-                        // save a copy of 1st data
-                        mByteBuffCpy[0] = *pData;
-                        gettimeofday(&tval_after, NULL);
-                        timersub(&tval_after, &tval_before, &tval_result);
-                            printf("[%ld.%06ld] sdb_thread data EVENT mDdrBuffAwaited=%d mNbUncompData=%u \n", 
-                                (long int)tval_result.tv_sec, (long int)tval_result.tv_usec, mDdrBuffAwaited, 
-                                mNbUncompData);
-                        gdk_threads_add_idle (refreshUI_CB, window);
-                    }
-                    else {
-                        printf("CA7 : sdb_thread => buf[%d] is empty\n", mDdrBuffAwaited);
-                    }
-                    mDdrBuffAwaited++;
-                    if (mDdrBuffAwaited >= NB_BUF) {
-                        mDdrBuffAwaited = 0;
-                    }
-                } else {
-                    // we may have started the timeout, but have stopped and started sampling in RPMSG
-                    if (mMachineState == STATE_SAMPLING_HIGH) {
-                        n = 0;
-                        for (i=0; i<NB_BUF; i++) {
-                            n += sprintf(dbgmsg+n, "[%d] ", (fds[i].revents & POLLIN));
-                        }
-                        printf("CA7 : sdb_thread wrong buffer index ERROR, waiting idx=%d buff status=%s\n", 
-                            mDdrBuffAwaited, dbgmsg);
-                        mErrorDetected = 2;
-                    }
-                }
+                ctrl_reply(client, "error unknown option %s\n", arg);
+                return;
+            }
+        }
+        if (mMachineState != STATE_READY) {
+            ctrl_reply(client, "error already sampling\n");
+            return;
+        }
+        if (event_loop_post(LA_CMD_START, freq, flags) < 0) {
+            ctrl_reply(client, "error busy\n");
+            return;
+        }
+    } else if (strcmp(arg, "stop") == 0) {
+        if (event_loop_post(LA_CMD_STOP, 0, 0) < 0) {
+            ctrl_reply(client, "error busy\n");
+            return;
+        }
+    } else if (strcmp(arg, "status") == 0) {
+        memset(&stats, 0, sizeof(stats));
+        if (mRecordRequested)
+            la_writer_get_stats(&stats);
+        ctrl_reply(client, "state=%s bytes=%u samples=%llu skipped=%u late=%u late_samples=%llu "
+            "overruns=%u record=%s written=%llu dropped=%llu rate=%.1f\n",
+            machine_state_str[mMachineState], mNbUncompData,
+            (unsigned long long)SHARED_GET(mNbSamples), mNbSkipped, mNbLate,
+            (unsigned long long)SHARED_GET(mNbLateSamples), mNbOverruns,
+            mRecordRequested ? (stats.error ? "error" : "on") : "off",
+            (unsigned long long)stats.written, (unsigned long long)stats.dropped, stats.rate_MBps);
+        return;
+    } else if (strcmp(arg, "quit") == 0) {
+        SHARED_SET(mThreadCancel, 1);
+        event_loop_notify();
+    } else {
+        ctrl_reply(client, "error unknown command %s\n", arg);
+        return;
+    }
+    ctrl_reply(client, "ok\n");
+}
+
+static ctrl_client *ctrl_client_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < CTRL_MAX_CLIENTS; i++) {
+        if (mCtrlClients[i].fd == fd)
+            return &mCtrlClients[i];
+    }
+    return NULL;
+}
+
+static void ctrl_client_close(ctrl_client *client)
+{
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static void ctrl_client_rx(ctrl_client *client)
+{
+    char *nl;
+    ssize_t len;
+    uint32_t used;
+
+    len = read(client->fd, client->line + client->len, CTRL_LINE_MAX - 1 - client->len);
+    if (len <= 0) {
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        ctrl_client_close(client);
+        return;
+    }
+    client->len += len;
+    client->line[client->len] = 0;
+    used = 0;
+    while ((nl = strchr(client->line + used, '\n')) != NULL) {
+        *nl = 0;
+        if (!client->discard)
+            ctrl_command(client, client->line + used);
+        client->discard = 0;
+        used = nl + 1 - client->line;
+    }
+    if (used == 0 && client->len == CTRL_LINE_MAX - 1) {
+        if (!client->discard)
+            ctrl_reply(client, "error line too long\n");
+        client->discard = 1;
+        used = client->len;
+    }
+    memmove(client->line, client->line + used, client->len - used);
+    client->len -= used;
+}
+
+static int event_loop_add(int fd);
+
+static void ctrl_socket_accept(void)
+{
+    ctrl_client *client;
+    int fd;
+
+    fd = accept4(mCtrlSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    client = ctrl_client_find(-1);
+    if (!client) {
+        printf("CA7 : ctrl => too many clients\n");
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->len = 0;
+    client->discard = 0;
+    if (event_loop_add(fd) < 0) {
+        close(fd);
+        client->fd = -1;
+    }
+}
+
+static void ctrl_socket_close(void)
+{
+    int i;
+
+    for (i = 0; i < CTRL_MAX_CLIENTS; i++) {
+        if (mCtrlClients[i].fd >= 0)
+            ctrl_client_close(&mCtrlClients[i]);
+    }
+    if (mCtrlSock >= 0) {
+        close(mCtrlSock);
+        unlink(mCtrlSockPath);
+        mCtrlSock = -1;
+    }
+}
+
+int ctrl_socket_open(void)
+{
+    struct sockaddr_un addr;
+    const char *path = getenv("LA_CTRL_SOCKET");
+    int i;
+
+    for (i = 0; i < CTRL_MAX_CLIENTS; i++)
+        mCtrlClients[i].fd = -1;
+    if (!path)
+        path = CTRL_SOCKET_PATH;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("CA7 : ctrl => socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(mCtrlSockPath, path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    mCtrlSock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mCtrlSock < 0) {
+        printf("CA7 : ctrl => Error creating the socket, err=-%d\n", errno);
+        return (errno * -1);
+    }
+    // a previous instance may have left its socket behind
+    unlink(path);
+    if (bind(mCtrlSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(mCtrlSock, CTRL_MAX_CLIENTS) < 0) {
+        printf("CA7 : ctrl => Error listening on %s, err=-%d\n", path, errno);
+        close(mCtrlSock);
+        mCtrlSock = -1;
+        return (errno * -1);
+    }
+    if (event_loop_add(mCtrlSock) < 0) {
+        ctrl_socket_close();
+        return -1;
+    }
+    printf("CA7 : ctrl => listening on %s\n", path);
+    return 0;
+}
+
+static int event_loop_add(int fd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        printf("CA7 : Error watching fd %d, err=-%d\n", fd, errno);
+        return (errno * -1);
+    }
+    return 0;
+}
+
+static void event_loop_watch(int fd, int on)
+{
+    struct epoll_event ev;
+
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        printf("CA7 : Error %s fd %d, err=-%d\n", on ? "resuming" : "pausing", fd, errno);
+}
+
+int event_loop_init(void)
+{
+    la_mpmc_init(&mCtrlQueue, mCtrlCells, CTRL_QUEUE_ENTRIES);
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    mCtrlEfd = eventfd(0, EFD_NONBLOCK);
+    if (mEpollFd == -1 || mCtrlEfd == -1) {
+        printf("CA7 : Error creating the event loop, err=-%d\n", errno);
+        return (errno * -1);
+    }
+    if (mAnaEfd >= 0 && event_loop_add(mAnaEfd))
+        return -1;
+    if (event_loop_add(mCtrlEfd) || event_loop_add(mRingEfd) ||
+        event_loop_add(mFdRpmsg[0]) || event_loop_add(mFdRpmsg[1]))
+        return -1;
+    return 0;
+}
+
+/*
+ * Every source of work is a file descriptor watched by a single epoll instance:
+ * completions are handled as soon as the driver signals the ring and the thread
+ * stays asleep as long as nothing happens. UI callbacks and the exit path kick
+ * the control eventfd so that a state change is taken into account immediately.
+ */
+void *event_loop_thread(void *arg)
+{
+    struct epoll_event events[8];
+    ctrl_client *client;
+    int i, n, fd, timeout;
+    uint64_t cnt;
+
+    while (!SHARED_GET(mThreadCancel)) {
+        // a high rate capture expects completions, otherwise sleep for good
+        timeout = (mMachineState == STATE_SAMPLING_HIGH) ? TIMEOUT * 1000 : -1;
+        n = epoll_wait(mEpollFd, events, 8, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait()");
+            break;
+        }
+        if (n == 0) {
+            printf("CA7 : No buffer data within %d seconds.\n", TIMEOUT);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == mCtrlEfd) {
+                read(mCtrlEfd, &cnt, sizeof(cnt));
+                event_loop_commands();
+            } else if (fd == mAnaEfd) {
+                read(mAnaEfd, &cnt, sizeof(cnt));
+                event_loop_analysis_done();
+            } else if (fd == mRingEfd) {
+                read(mRingEfd, &cnt, sizeof(cnt));
+                sdb_drain_ring();
+            } else if (fd == mCtrlSock) {
+                ctrl_socket_accept();
+            } else if ((client = ctrl_client_find(fd)) != NULL) {
+                // a hang up reads as end of file and closes the client
+                ctrl_client_rx(client);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                // the remote endpoint is gone, stop watching it rather than spinning
+                printf("CA7 : ttyRPMSG fd %d hung up\n", fd);
+                epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+            } else if (fd == mFdRpmsg[0]) {
+                virtual_tty_rx_data();
+            } else if (fd == mFdRpmsg[1]) {
+                virtual_tty_rx_trace();
             }
         }
-        sleep_ms(5);      // give time to UI
-       
     }
+    // queue what is still staged, main waits for it to be written
+    la_writer_close();
+    ctrl_socket_close();
+    if (mAnaRunning)
+        sem_post(&mAnaSem);
     return 0;
 }
 int main(int argc, char **argv)
 {
-    int ret = 0, i, cmd;
+    int ret = 0, i;
     char FwName[30];
     strcpy(FIRM_NAME, "how2eldb04140.elf");
     /* check if copro is already running */
@@ -970,7 +2272,6 @@ int main(int argc, char **argv)
         }
     }
  
-setname:
     /* set the firmware name to load */
     ret = copro_setFwName(FIRM_NAME);
     if (ret <= 0) {
@@ -991,14 +2292,24 @@ fwrunning:
     signal(SIGTERM, exit_fct); /* kill command */
     gettimeofday(&tval_before, NULL);    // get current time
    
-    if (pthread_create( &threadTTY, NULL, virtual_tty_thread, NULL) != 0) {
-        printf("CA7 : virtual_tty_thread creation fails\n");
+    if (virtual_tty_open()) {
         goto end;
     }
-
-    sleep_ms(500);  // let tty send the DDR buffer command
-    if (pthread_create( &threadSDB, NULL, sdb_thread, NULL) != 0) {
-        printf("CA7 : sdb_thread creation fails\n");
+    sdb_open();
+    if (analysis_init()) {
+        printf("CA7 : running without analysis\n");
+    }
+    if (la_writer_init()) {
+        printf("CA7 : running without recording\n");
+    }
+    if (event_loop_init()) {
+        goto end;
+    }
+    if (ctrl_socket_open()) {
+        printf("CA7 : running without control socket\n");
+    }
+    if (pthread_create( &threadEvent, NULL, event_loop_thread, NULL) != 0) {
+        printf("CA7 : event_loop_thread creation fails\n");
         goto end;
     }
 
@@ -1008,42 +2319,42 @@ fwrunning:
     mSampFreq_Hz = 4;
     mSampParmCount = 0;
 
-    gtk_init (&argc, &argv);
-   
-    if (pthread_create( &threadUI, NULL, ui_thread, NULL) != 0) {
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0)
+            mHeadless = 1;
+    }
+#ifndef LA_HEADLESS
+    if (!mHeadless && !gtk_init_check (&argc, &argv)) {
+        printf("CA7 : no display\n");
+        mHeadless = 1;
+    }
+    if (!mHeadless && pthread_create( &threadUI, NULL, ui_thread, NULL) != 0) {
         printf("CA7 : ui_thread creation fails\n");
         goto end;
     }
+#endif
+    if (mHeadless) {
+        printf("CA7 : headless, control through %s\n", mCtrlSock >= 0 ? mCtrlSockPath : "signals only");
+    }
 
     printf("CA7 : Entering in Main loop\n");
  
-    while (1) {
-        if (mExitRequested) break;
-        if (mErrorDetected) {
-            if (mMachineState >= STATE_SAMPLING_LOW) {
-                virtual_tty_send_command(strlen("Exit"), "Exit");
-                if (mErrorDetected == 2) printf("CA7 : ERROR in DDR Buffer order => Stop sampling!!!\n");
-                //else if (mErrorDetected == 2) printf("CA7 : File System full => Stop sampling!!!\n");
-                else if (mErrorDetected == 1) printf("CA7 : M4 reported DMA error !!!\n");
-                mErrorDetected = 0;
-                mMachineState = STATE_READY;
-                gdk_threads_add_idle (refreshUI_CB, window);
-#if 0
-            close_raw_file();
-#endif
-            }
-        }
-        sleep_ms(1);      // give time to UI
-    }
-    for (i=0;i<NB_BUF;i++){
-        int rc = munmap(mmappedData[i], DATA_BUF_POOL_SIZE);
-        assert(rc == 0);
-    }
+    // all the work is done by the event loop, wait for it to be cancelled
+    pthread_join(threadEvent, NULL);
+    if (mAnaRunning)
+        pthread_join(threadAnalysis, NULL);
+    // the event loop only queued the end of the recording, wait for the card
+    la_writer_exit();
+    int rc = munmap(mmappedPool, NB_BUF * DATA_BUF_POOL_SIZE);
+    assert(rc == 0);
     fMappedData = 0;
     printf("CA7 : Buffers successfully unmapped\n");
+    munmap(mRing, mRingSize);
+    mRing = NULL;
  
 end:
-    mThreadCancel = 1;
+    SHARED_SET(mThreadCancel, 1);
+    event_loop_notify();
     sleep_ms(100);
     /* check if copro is already running */
     if (copro_isFwRunning()) {
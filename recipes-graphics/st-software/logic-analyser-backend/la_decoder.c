@@ -0,0 +1,123 @@
+/*
+* la_decoder.c
+* Decoder of the compressed sample stream of the logic analyser.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "la_decoder.h"
+
+#define LA_BLOCK 16                             /* bytes expanded per vector step */
+#define LA_BLOCK_OUT (LA_BLOCK * LA_RUN_MAX)    /* worst case samples of a step */
+
+#if defined(__ARM_NEON)
+#define LA_STORE_RUN(half, lane, idx) \
+    vst1_u8(out + start[idx], vdup_lane_u8(half, lane))
+
+/*
+ * Expand 16 bytes at once: the start of each run is the exclusive prefix sum
+ * of the run lengths (at most 128, no lane overflows), then each run is stored
+ * as 8 copies of its sample and the next run overwrites what is in excess.
+ * out must have room for LA_BLOCK_OUT samples.
+ */
+static uint32_t la_expand_neon(const uint8_t *in, uint8_t *out)
+{
+    uint8x16_t raw = vld1q_u8(in);
+    uint8x16_t zero = vdupq_n_u8(0);
+    uint8x16_t vals = vandq_u8(raw, vdupq_n_u8(LA_SAMPLE_MASK));
+    uint8x16_t runs = vaddq_u8(vshrq_n_u8(raw, LA_SAMPLE_BITS), vdupq_n_u8(1));
+    uint8x16_t end = runs;
+    uint8x8_t lo = vget_low_u8(vals);
+    uint8x8_t hi = vget_high_u8(vals);
+    uint8_t start[LA_BLOCK];
+
+    end = vaddq_u8(end, vextq_u8(zero, end, 15));
+    end = vaddq_u8(end, vextq_u8(zero, end, 14));
+    end = vaddq_u8(end, vextq_u8(zero, end, 12));
+    end = vaddq_u8(end, vextq_u8(zero, end, 8));
+    vst1q_u8(start, vsubq_u8(end, runs));
+
+    LA_STORE_RUN(lo, 0, 0);
+    LA_STORE_RUN(lo, 1, 1);
+    LA_STORE_RUN(lo, 2, 2);
+    LA_STORE_RUN(lo, 3, 3);
+    LA_STORE_RUN(lo, 4, 4);
+    LA_STORE_RUN(lo, 5, 5);
+    LA_STORE_RUN(lo, 6, 6);
+    LA_STORE_RUN(lo, 7, 7);
+    LA_STORE_RUN(hi, 0, 8);
+    LA_STORE_RUN(hi, 1, 9);
+    LA_STORE_RUN(hi, 2, 10);
+    LA_STORE_RUN(hi, 3, 11);
+    LA_STORE_RUN(hi, 4, 12);
+    LA_STORE_RUN(hi, 5, 13);
+    LA_STORE_RUN(hi, 6, 14);
+    LA_STORE_RUN(hi, 7, 15);
+    return vgetq_lane_u8(end, 15);
+}
+#endif
+
+void la_decoder_init(la_decoder *dec)
+{
+    memset(dec, 0, sizeof(*dec));
+}
+
+uint32_t la_decoder_run(la_decoder *dec, const uint8_t *in, uint32_t len, uint32_t *used,
+                        uint8_t *out, uint32_t cap)
+{
+    uint32_t i = 0, n = 0, run;
+    uint8_t b;
+
+    // finish the run the previous output buffer had no room for
+    if (dec->pending) {
+        run = dec->pending < cap ? dec->pending : cap;
+        memset(out, dec->value, run);
+        n = run;
+        dec->pending -= run;
+        if (dec->pending) {
+            *used = 0;
+            dec->samples += n;
+            return n;
+        }
+    }
+#if defined(__ARM_NEON)
+    while (len - i >= LA_BLOCK && cap - n >= LA_BLOCK_OUT) {
+        n += la_expand_neon(in + i, out + n);
+        i += LA_BLOCK;
+    }
+#endif
+    while (i < len && n < cap) {
+        b = in[i++];
+        run = (b >> LA_SAMPLE_BITS) + 1;
+        if (run > cap - n) {
+            dec->value = b & LA_SAMPLE_MASK;
+            dec->pending = run - (cap - n);
+            run = cap - n;
+        }
+        memset(out + n, b & LA_SAMPLE_MASK, run);
+        n += run;
+    }
+    *used = i;
+    dec->samples += n;
+    return n;
+}
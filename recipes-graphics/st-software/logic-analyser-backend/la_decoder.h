@@ -0,0 +1,68 @@
+/*
+* la_decoder.h
+* Decoder of the compressed sample stream of the logic analyser.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * Compressed stream format
+ *
+ * The Cortex-M4 samples PE8..PE12 and sends each run of identical samples as
+ * one byte, over the SDB buffers as well as over ttyRPMSG0:
+ *
+ *     bit   7   6   5   4   3   2   1   0
+ *         [ repeat  ] [ PE12 .......  PE8 ]
+ *
+ * The low 5 bits are the sample (bit n is PE(8+n)) and repeat the number of
+ * times it occurs after the first one, so a byte stands for 1 to 8 samples.
+ * A longer run takes several bytes carrying the same sample. Bytes are
+ * independent, a buffer can end anywhere.
+ *
+ * Decoded samples are one byte each, with the same 5 low bits and the upper
+ * bits cleared.
+ */
+
+#ifndef LA_DECODER_H
+#define LA_DECODER_H
+
+#include <stdint.h>
+
+#define LA_SAMPLE_BITS 5
+#define LA_SAMPLE_MASK ((1 << LA_SAMPLE_BITS) - 1)
+#define LA_RUN_MAX 8
+
+typedef struct
+{
+    uint8_t value;          /* sample of the run left over by the last call */
+    uint8_t pending;        /* samples of that run not output yet */
+    uint64_t samples;       /* samples output since la_decoder_init() */
+} la_decoder;
+
+void la_decoder_init(la_decoder *dec);
+
+/*
+ * Expand up to len compressed bytes into at most cap samples. Returns the
+ * number of samples written to out and sets *used to the number of bytes
+ * consumed. A run that doesn't fit in out is kept in dec and output first by
+ * the next call, so the caller loops until *used == len and dec->pending == 0.
+ */
+uint32_t la_decoder_run(la_decoder *dec, const uint8_t *in, uint32_t len, uint32_t *used,
+                        uint8_t *out, uint32_t cap);
+
+#endif /* LA_DECODER_H */
@@ -0,0 +1,235 @@
+/*
+* la_index.c
+* Per-channel transition index of a capture.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "la_index.h"
+
+void la_index_init(la_index *idx, uint64_t max_bytes)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->max_bytes = max_bytes;
+}
+
+void la_index_free(la_index *idx)
+{
+    uint32_t b;
+    int c;
+
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        for (b = 0; b < idx->ch[c].nb_blocks; b++)
+            free(idx->ch[c].block[b].delta);
+        free(idx->ch[c].block);
+    }
+    la_index_init(idx, idx->max_bytes);
+}
+
+// the last block of the channel if it can take a transition at pos, else a new one
+static la_index_block *la_index_block_for(la_index *idx, la_index_channel *ch, uint64_t pos)
+{
+    la_index_block *blk = ch->nb_blocks ? &ch->block[ch->nb_blocks - 1] : NULL;
+    la_index_block *tab;
+    uint64_t before = 0;
+
+    if (blk && blk->count < LA_INDEX_BLOCK && pos - blk->first <= UINT32_MAX)
+        return blk;
+    if (blk) {
+        // closed for good, give back what it doesn't use
+        if (blk->count < LA_INDEX_BLOCK) {
+            uint32_t *delta = realloc(blk->delta, blk->count * sizeof(uint32_t));
+            if (delta) {
+                blk->delta = delta;
+                idx->bytes -= (LA_INDEX_BLOCK - blk->count) * sizeof(uint32_t);
+            }
+        }
+        before = blk->before + blk->count;
+    }
+    if (idx->bytes + sizeof(*blk) + LA_INDEX_BLOCK * sizeof(uint32_t) > idx->max_bytes)
+        return NULL;
+    if (ch->nb_blocks == ch->max_blocks) {
+        uint32_t max = ch->max_blocks ? ch->max_blocks * 2 : 64;
+        tab = realloc(ch->block, max * sizeof(*tab));
+        if (!tab)
+            return NULL;
+        idx->bytes += (max - ch->max_blocks) * sizeof(*tab);
+        ch->block = tab;
+        ch->max_blocks = max;
+    }
+    blk = &ch->block[ch->nb_blocks];
+    blk->delta = malloc(LA_INDEX_BLOCK * sizeof(uint32_t));
+    if (!blk->delta)
+        return NULL;
+    idx->bytes += LA_INDEX_BLOCK * sizeof(uint32_t);
+    blk->first = blk->last = pos;
+    blk->before = before;
+    blk->count = 0;
+    ch->nb_blocks++;
+    return blk;
+}
+
+void la_index_add(la_index *idx, uint8_t *const planes[LA_NB_CHANNELS], uint32_t nbytes)
+{
+    la_index_channel *ch;
+    la_index_block *blk;
+    uint64_t word, diff, base, pos;
+    uint32_t i, n;
+    int c;
+
+    if (nbytes == 0)
+        return;
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        ch = &idx->ch[c];
+        if (idx->samples == 0)
+            ch->initial = ch->level = planes[c][0] & 1;
+        // 64 samples at a time: bit i of diff is set if sample i differs from
+        // the sample before it
+        for (i = 0; i < nbytes && !idx->truncated; i += 8) {
+            n = nbytes - i < 8 ? nbytes - i : 8;
+            word = 0;
+            memcpy(&word, planes[c] + i, n);
+            diff = word ^ ((word << 1) | ch->level);
+            if (n < 8)
+                diff &= (1ULL << (n * 8)) - 1;
+            ch->level = (word >> (n * 8 - 1)) & 1;
+            base = idx->samples + (uint64_t)i * 8;
+            while (diff) {
+                pos = base + __builtin_ctzll(diff);
+                diff &= diff - 1;
+                blk = la_index_block_for(idx, ch, pos);
+                if (!blk) {
+                    // the channels after this one miss the whole call
+                    idx->truncated = 1;
+                    idx->complete = idx->samples;
+                    break;
+                }
+                blk->delta[blk->count++] = pos - blk->first;
+                blk->last = pos;
+            }
+        }
+    }
+    idx->samples += (uint64_t)nbytes * 8;
+    if (!idx->truncated)
+        idx->complete = idx->samples;
+}
+
+// first block of the channel whose last transition is after from, nb_blocks if none
+static uint32_t la_index_find_block(const la_index_channel *ch, uint64_t from)
+{
+    uint32_t lo = 0, hi = ch->nb_blocks, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ch->block[mid].last > from)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// number of transitions of the block at or before sample pos
+static uint32_t la_index_count_upto(const la_index_block *blk, uint64_t pos)
+{
+    uint32_t lo = 0, hi = blk->count, mid;
+
+    if (pos < blk->first)
+        return 0;
+    if (pos - blk->first >= UINT32_MAX)
+        return blk->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (blk->delta[mid] <= pos - blk->first)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int la_index_next_edge(const la_index *idx, int ch, uint64_t from, int dir, uint64_t *pos)
+{
+    const la_index_channel *chan = &idx->ch[ch];
+    const la_index_block *blk;
+    uint32_t b, i;
+    uint64_t k;
+
+    b = la_index_find_block(chan, from);
+    if (b == chan->nb_blocks)
+        return -1;
+    blk = &chan->block[b];
+    i = la_index_count_upto(blk, from);
+    k = blk->before + i;
+    // transition k leaves the channel at initial ^ ((k + 1) & 1), transitions
+    // alternate so the next one has the other direction
+    if (dir != LA_EDGE_ANY && (int)(chan->initial ^ ((k + 1) & 1)) != dir) {
+        i++;
+        if (i >= blk->count) {
+            if (++b == chan->nb_blocks)
+                return -1;
+            blk = &chan->block[b];
+            i = 0;
+        }
+    }
+    if (blk->first + blk->delta[i] >= idx->complete)
+        return -1;
+    *pos = blk->first + blk->delta[i];
+    return 0;
+}
+
+int la_index_level_at(const la_index *idx, uint64_t pos, uint8_t *levels)
+{
+    const la_index_channel *chan;
+    const la_index_block *blk;
+    uint64_t k;
+    uint32_t b;
+    int c;
+
+    if (pos >= idx->complete)
+        return -1;
+    *levels = 0;
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        chan = &idx->ch[c];
+        // the block holding pos, or the first one after it
+        b = la_index_find_block(chan, pos);
+        if (b < chan->nb_blocks && chan->block[b].first <= pos) {
+            blk = &chan->block[b];
+            k = blk->before + la_index_count_upto(blk, pos);
+        } else if (b > 0) {
+            blk = &chan->block[b - 1];
+            k = blk->before + blk->count;
+        } else {
+            k = 0;
+        }
+        *levels |= (chan->initial ^ (k & 1)) << c;
+    }
+    return 0;
+}
+
+uint64_t la_index_transitions(const la_index *idx, int ch)
+{
+    const la_index_channel *chan = &idx->ch[ch];
+
+    if (chan->nb_blocks == 0)
+        return 0;
+    return chan->block[chan->nb_blocks - 1].before + chan->block[chan->nb_blocks - 1].count;
+}
@@ -0,0 +1,98 @@
+/*
+* la_index.h
+* Per-channel transition index of a capture.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * Every transition of every channel is recorded, in blocks of up to
+ * LA_INDEX_BLOCK transitions. A block stores the sample index of its first
+ * and last transitions, its number of transitions, the number of transitions
+ * of the channel before it, and each position as a 32 bit offset from the
+ * first one (a block is closed early rather than span more than 2^32
+ * samples).
+ *
+ * Blocks are sorted by construction, so finding the block holding a sample
+ * is a binary search, and so is finding the transition in the block. The
+ * level of a channel after transition k is its initial level flipped k + 1
+ * times, which tells rising from falling edges without storing it. Jumping
+ * to a time T of a capture sampled at f is la_index_level_at(T * f).
+ *
+ * The index is not thread safe, it belongs to the stage that feeds it.
+ */
+
+#ifndef LA_INDEX_H
+#define LA_INDEX_H
+
+#include <stdint.h>
+#include "la_transpose.h"
+
+#define LA_INDEX_BLOCK 1024
+
+#define LA_EDGE_ANY (-1)
+#define LA_EDGE_FALLING 0
+#define LA_EDGE_RISING 1
+
+typedef struct
+{
+    uint64_t first;         /* sample index of the first transition */
+    uint64_t last;          /* sample index of the last transition */
+    uint64_t before;        /* transitions of the channel before this block */
+    uint32_t count;
+    uint32_t *delta;        /* position of each transition minus first */
+} la_index_block;
+
+typedef struct
+{
+    la_index_block *block;
+    uint32_t nb_blocks;     /* the last one is still open if not full */
+    uint32_t max_blocks;
+    uint8_t initial;        /* level at sample 0 */
+    uint8_t level;          /* level of the last sample indexed */
+} la_index_channel;
+
+typedef struct
+{
+    la_index_channel ch[LA_NB_CHANNELS];
+    uint64_t samples;       /* samples indexed so far */
+    uint64_t complete;      /* samples before this one have all their transitions */
+    uint64_t bytes;         /* memory used by the blocks */
+    uint64_t max_bytes;
+    int truncated;          /* memory budget exceeded, later transitions are missing */
+} la_index;
+
+void la_index_init(la_index *idx, uint64_t max_bytes);
+void la_index_free(la_index *idx);
+
+/* index the next nbytes * 8 samples, given as planes (see la_transpose.h) */
+void la_index_add(la_index *idx, uint8_t *const planes[LA_NB_CHANNELS], uint32_t nbytes);
+
+/*
+ * Find the first transition of channel ch after sample from, in direction
+ * dir (LA_EDGE_*). Returns 0 and sets *pos, -1 if there is none or the
+ * memory budget ran out before it.
+ */
+int la_index_next_edge(const la_index *idx, int ch, uint64_t from, int dir, uint64_t *pos);
+
+/* level of each channel at sample pos (bit c for channel c), -1 if not indexed */
+int la_index_level_at(const la_index *idx, uint64_t pos, uint8_t *levels);
+
+uint64_t la_index_transitions(const la_index *idx, int ch);
+
+#endif /* LA_INDEX_H */
@@ -0,0 +1,157 @@
+/*
+* la_pyramid.c
+* Multi-resolution summary of a capture for the waveform view.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "la_pyramid.h"
+
+void la_pyramid_init(la_pyramid *pyr, uint64_t max_bytes)
+{
+    memset(pyr, 0, sizeof(*pyr));
+    pyr->max_bytes = max_bytes;
+}
+
+void la_pyramid_free(la_pyramid *pyr)
+{
+    uint32_t k;
+
+    for (k = 0; k < pyr->nb_levels; k++)
+        free(pyr->level[k].cell);
+    la_pyramid_init(pyr, pyr->max_bytes);
+}
+
+static int la_pyramid_append(la_pyramid *pyr, la_pyramid_level *lvl, uint16_t cell)
+{
+    uint16_t *tab;
+    uint64_t max;
+
+    if (lvl->nb_cells == lvl->max_cells) {
+        max = lvl->max_cells ? lvl->max_cells * 2 : 1024;
+        if (pyr->bytes + (max - lvl->max_cells) * sizeof(*tab) > pyr->max_bytes)
+            return -1;
+        tab = realloc(lvl->cell, max * sizeof(*tab));
+        if (!tab)
+            return -1;
+        pyr->bytes += (max - lvl->max_cells) * sizeof(*tab);
+        lvl->cell = tab;
+        lvl->max_cells = max;
+    }
+    lvl->cell[lvl->nb_cells++] = cell;
+    return 0;
+}
+
+// a base cell is complete, add it and fold it into the cells above
+static int la_pyramid_push(la_pyramid *pyr, uint16_t cell)
+{
+    la_pyramid_level *lvl = &pyr->level[0];
+    uint64_t i;
+    uint32_t k;
+
+    if (pyr->nb_levels == 0)
+        pyr->nb_levels = 1;
+    if (la_pyramid_append(pyr, lvl, cell) < 0)
+        return -1;
+    i = lvl->nb_cells - 1;
+    for (k = 1; k < LA_PYRAMID_LEVELS && pyr->level[k - 1].nb_cells > 1; k++) {
+        lvl = &pyr->level[k];
+        if ((i >> 1) < lvl->nb_cells) {
+            lvl->cell[i >> 1] |= cell;
+        } else {
+            // a new cell, or a new level whose first cell covers both below
+            if (i & 1)
+                cell |= pyr->level[k - 1].cell[i - 1];
+            if (la_pyramid_append(pyr, lvl, cell) < 0)
+                return -1;
+            if (k == pyr->nb_levels)
+                pyr->nb_levels++;
+        }
+        cell = lvl->cell[i >> 1];
+        i >>= 1;
+    }
+    return 0;
+}
+
+void la_pyramid_add(la_pyramid *pyr, uint8_t *const planes[LA_NB_CHANNELS], uint32_t nbytes)
+{
+    uint32_t i = 0, j, n, b;
+    uint8_t any, all;
+    int c;
+
+    while (i < nbytes && !pyr->truncated) {
+        // up to the end of the base cell being filled
+        n = (LA_PYRAMID_BASE - (pyr->samples & (LA_PYRAMID_BASE - 1))) / 8;
+        if (n > nbytes - i)
+            n = nbytes - i;
+        for (c = 0; c < LA_NB_CHANNELS; c++) {
+            any = 0;
+            all = 0xff;
+            for (j = i; j < i + n; j++) {
+                b = planes[c][j];
+                any |= b;
+                all &= b;
+            }
+            if (any)
+                pyr->cur |= LA_PYR_HIGH(c);
+            if (all != 0xff)
+                pyr->cur |= LA_PYR_LOW(c);
+        }
+        i += n;
+        pyr->samples += n * 8;
+        if ((pyr->samples & (LA_PYRAMID_BASE - 1)) == 0) {
+            if (la_pyramid_push(pyr, pyr->cur) < 0)
+                pyr->truncated = 1;
+            pyr->cur = 0;
+        }
+    }
+}
+
+uint32_t la_pyramid_render(const la_pyramid *pyr, uint64_t start, uint64_t span,
+                           uint32_t ncols, uint16_t *out)
+{
+    const la_pyramid_level *lvl;
+    uint64_t first, last, i;
+    uint32_t col, k = 0, shift, done = 0;
+    uint16_t cell;
+
+    if (span == 0)
+        span = 1;
+    // the largest cells no longer than a column
+    while (k + 1 < pyr->nb_levels && ((uint64_t)LA_PYRAMID_BASE << (k + 1)) <= span)
+        k++;
+    lvl = &pyr->level[k];
+    shift = LA_PYRAMID_SHIFT + k;
+    for (col = 0; col < ncols; col++) {
+        first = (start + col * span) >> shift;
+        last = (start + col * span + span - 1) >> shift;
+        cell = 0;
+        if (pyr->nb_levels && first < lvl->nb_cells) {
+            if (last >= lvl->nb_cells)
+                last = lvl->nb_cells - 1;
+            for (i = first; i <= last; i++)
+                cell |= lvl->cell[i];
+            done = col + 1;
+        }
+        out[col] = cell;
+    }
+    return done;
+}
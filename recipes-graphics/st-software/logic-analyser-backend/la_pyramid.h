@@ -0,0 +1,86 @@
+/*
+* la_pyramid.h
+* Multi-resolution summary of a capture for the waveform view.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * Level 0 has one cell per LA_PYRAMID_BASE samples, level k one per
+ * LA_PYRAMID_BASE << k samples, each cell being the OR of the two cells below
+ * it. A cell tells for each channel whether it was low and whether it was high
+ * somewhere in its span, both meaning it toggled.
+ *
+ * Rendering a viewport takes the level whose cells are just shorter than a
+ * column, so a column touches at most 3 cells whatever the zoom. The cells at
+ * the edges of a column may overlap the next one, a toggle can show one
+ * column early. Below LA_PYRAMID_BASE samples per column the index
+ * (la_index.h) gives the exact picture.
+ *
+ * The cells are added as the base ones complete, the partial upper cells are
+ * updated on the way. The pyramid is not thread safe, it belongs to the stage
+ * that feeds it.
+ */
+
+#ifndef LA_PYRAMID_H
+#define LA_PYRAMID_H
+
+#include <stdint.h>
+#include "la_transpose.h"
+
+#define LA_PYRAMID_SHIFT 10
+#define LA_PYRAMID_BASE (1 << LA_PYRAMID_SHIFT)
+#define LA_PYRAMID_LEVELS 40
+
+#define LA_PYR_LOW(c) (1 << (2 * (c)))
+#define LA_PYR_HIGH(c) (2 << (2 * (c)))
+#define LA_PYR_TOGGLED(cell, c) ((((cell) >> (2 * (c))) & 3) == 3)
+
+typedef struct
+{
+    uint16_t *cell;
+    uint64_t nb_cells;
+    uint64_t max_cells;
+} la_pyramid_level;
+
+typedef struct
+{
+    la_pyramid_level level[LA_PYRAMID_LEVELS];
+    uint32_t nb_levels;
+    uint16_t cur;           /* base cell being filled */
+    uint64_t samples;       /* samples added so far */
+    uint64_t bytes;         /* memory used by the cells */
+    uint64_t max_bytes;
+    int truncated;          /* memory budget exceeded, later samples are missing */
+} la_pyramid;
+
+void la_pyramid_init(la_pyramid *pyr, uint64_t max_bytes);
+void la_pyramid_free(la_pyramid *pyr);
+
+/* add the next nbytes * 8 samples, given as planes (see la_transpose.h) */
+void la_pyramid_add(la_pyramid *pyr, uint8_t *const planes[LA_NB_CHANNELS], uint32_t nbytes);
+
+/*
+ * Summarise ncols columns of span samples each, starting at sample start, one
+ * cell per column in out. Returns the number of columns reaching into the
+ * complete base cells, the columns after them are set to 0.
+ */
+uint32_t la_pyramid_render(const la_pyramid *pyr, uint64_t start, uint64_t span,
+                           uint32_t ncols, uint16_t *out);
+
+#endif /* LA_PYRAMID_H */
@@ -0,0 +1,185 @@
+/*
+* la_queue.h
+* Lock-free descriptor queues between the stages of the logic analyser backend.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * Two bounded queues of descriptors, the storage is provided by the caller
+ * and its number of entries must be a power of 2:
+ *
+ * - la_spsc, one producer thread and one consumer thread. Each side owns an
+ *   index on its own cache line and keeps a cached copy of the other index,
+ *   so it only reads the shared one when the queue looks full or empty.
+ * - la_mpmc, any number of producers and consumers (D. Vyukov's bounded
+ *   queue): each cell carries a sequence number telling whether it is free
+ *   for the lap of the producer or filled for the lap of the consumer.
+ *
+ * Neither queue blocks, a stage that has to sleep pairs it with an eventfd
+ * or a semaphore.
+ */
+
+#ifndef LA_QUEUE_H
+#define LA_QUEUE_H
+
+#include <stdint.h>
+
+#define LA_CACHE_LINE 64    /* Cortex-A7 L1 data cache line */
+#define LA_ALIGNED __attribute__((aligned(LA_CACHE_LINE)))
+
+typedef struct
+{
+    uint32_t type;          /* meaning is up to the stages exchanging it */
+    uint32_t id;            /* buffer, chunk or command argument */
+    uint32_t size;
+    uint32_t seq;
+    uint32_t flags;
+    const void *data;
+} la_desc;
+
+typedef struct
+{
+    uint32_t tail LA_ALIGNED;       /* written by the producer */
+    uint32_t head_cache;
+    uint32_t head LA_ALIGNED;       /* written by the consumer */
+    uint32_t tail_cache;
+    uint32_t mask LA_ALIGNED;
+    la_desc *slot;
+} la_spsc;
+
+typedef struct
+{
+    uint32_t seq;
+    la_desc desc;
+} la_mpmc_cell;
+
+typedef struct
+{
+    uint32_t enq LA_ALIGNED;
+    uint32_t deq LA_ALIGNED;
+    uint32_t mask LA_ALIGNED;
+    la_mpmc_cell *cell;
+} la_mpmc;
+
+static inline void la_spsc_init(la_spsc *q, la_desc *slot, uint32_t entries)
+{
+    q->tail = q->head_cache = 0;
+    q->head = q->tail_cache = 0;
+    q->mask = entries - 1;
+    q->slot = slot;
+}
+
+// returns -1 if the queue is full
+static inline int la_spsc_push(la_spsc *q, const la_desc *desc)
+{
+    uint32_t tail = q->tail;
+
+    if (tail - q->head_cache > q->mask) {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache > q->mask)
+            return -1;
+    }
+    q->slot[tail & q->mask] = *desc;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// returns -1 if the queue is empty
+static inline int la_spsc_pop(la_spsc *q, la_desc *desc)
+{
+    uint32_t head = q->head;
+
+    if (head == q->tail_cache) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->tail_cache)
+            return -1;
+    }
+    *desc = q->slot[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// only a hint when called from a third thread
+static inline uint32_t la_spsc_count(la_spsc *q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+static inline void la_mpmc_init(la_mpmc *q, la_mpmc_cell *cell, uint32_t entries)
+{
+    uint32_t i;
+
+    for (i = 0; i < entries; i++)
+        cell[i].seq = i;
+    q->enq = q->deq = 0;
+    q->mask = entries - 1;
+    q->cell = cell;
+}
+
+// returns -1 if the queue is full
+static inline int la_mpmc_push(la_mpmc *q, const la_desc *desc)
+{
+    uint32_t pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    la_mpmc_cell *cell;
+    int32_t diff;
+
+    while (1) {
+        cell = &q->cell[pos & q->mask];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+        }
+    }
+    cell->desc = *desc;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// returns -1 if the queue is empty
+static inline int la_mpmc_pop(la_mpmc *q, la_desc *desc)
+{
+    uint32_t pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    la_mpmc_cell *cell;
+    int32_t diff;
+
+    while (1) {
+        cell = &q->cell[pos & q->mask];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+        }
+    }
+    *desc = cell->desc;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif /* LA_QUEUE_H */
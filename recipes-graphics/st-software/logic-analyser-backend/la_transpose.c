@@ -0,0 +1,124 @@
+/*
+* la_transpose.c
+* Bit-plane transposition of the decoded samples.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "la_transpose.h"
+
+/*
+ * 8 samples to one byte per plane: the multiply gathers bit 0 of each byte of
+ * x into the top byte, byte k landing in bit 56 + k (the partial products
+ * never overlap). Samples are loaded little endian, sample 0 in byte 0.
+ */
+static inline void la_transpose8(const uint8_t *in, uint8_t *const planes[], uint32_t pos)
+{
+    uint64_t x;
+    int c;
+
+    memcpy(&x, in, sizeof(x));
+    for (c = 0; c < LA_NB_CHANNELS; c++)
+        planes[c][pos] = (((x >> c) & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+}
+
+#if defined(__ARM_NEON)
+static const uint8_t la_bit_weights[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+};
+
+/*
+ * 16 samples to two bytes per plane: each lane of the channel becomes its
+ * weight in the plane byte, then three pairwise additions sum each half.
+ */
+static inline void la_transpose16(const uint8_t *in, uint8_t *const planes[], uint32_t pos)
+{
+    uint8x16_t v = vld1q_u8(in);
+    uint8x16_t w = vld1q_u8(la_bit_weights);
+    uint8x16_t m;
+    uint8x8_t p;
+    int c;
+
+#define LA_PLANE(c) \
+    m = vandq_u8(vtstq_u8(v, vdupq_n_u8(1 << (c))), w); \
+    p = vpadd_u8(vget_low_u8(m), vget_high_u8(m)); \
+    p = vpadd_u8(p, p); \
+    p = vpadd_u8(p, p); \
+    planes[c][pos] = vget_lane_u8(p, 0); \
+    planes[c][pos + 1] = vget_lane_u8(p, 1);
+
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        LA_PLANE(c);
+    }
+#undef LA_PLANE
+}
+#elif defined(__SSE2__)
+/*
+ * 16 samples to two bytes per plane: shifting the 64 bit lanes left moves bit
+ * c of each byte to its bit 7 (lower bytes spill into the low bits only), and
+ * movemask gathers the bit 7 of the 16 bytes.
+ */
+static inline void la_transpose16(const uint8_t *in, uint8_t *const planes[], uint32_t pos)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    int c, bits;
+
+    for (c = 0; c < LA_NB_CHANNELS; c++) {
+        bits = _mm_movemask_epi8(_mm_slli_epi64(v, 7 - c));
+        planes[c][pos] = bits;
+        planes[c][pos + 1] = bits >> 8;
+    }
+}
+#endif
+
+void la_transposer_init(la_transposer *t)
+{
+    memset(t, 0, sizeof(*t));
+}
+
+uint32_t la_transpose_run(la_transposer *t, const uint8_t *samples, uint32_t count,
+                          uint8_t *const planes[LA_NB_CHANNELS], uint32_t pos)
+{
+    uint32_t start = pos, i = 0;
+
+    // complete the byte started by the previous call
+    if (t->ncarry) {
+        while (t->ncarry < 8 && i < count)
+            t->carry[t->ncarry++] = samples[i++];
+        if (t->ncarry < 8)
+            return 0;
+        la_transpose8(t->carry, planes, pos++);
+        t->ncarry = 0;
+    }
+#if defined(__ARM_NEON) || defined(__SSE2__)
+    for (; count - i >= 16; i += 16, pos += 2)
+        la_transpose16(samples + i, planes, pos);
+#endif
+    for (; count - i >= 8; i += 8)
+        la_transpose8(samples + i, planes, pos++);
+    while (i < count)
+        t->carry[t->ncarry++] = samples[i++];
+    return pos - start;
+}
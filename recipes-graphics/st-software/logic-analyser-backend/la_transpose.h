@@ -0,0 +1,54 @@
+/*
+* la_transpose.h
+* Bit-plane transposition of the decoded samples.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * The decoded samples are one byte each, PE8..PE12 in bits 0 to 4. Most of
+ * the processing is per channel, so the samples are split into one bitstream
+ * per channel ("plane"): byte n of plane c holds bit c of samples 8n to
+ * 8n + 7, the oldest sample in bit 0. Downstream stages then move 1 bit per
+ * sample and channel instead of 8.
+ */
+
+#ifndef LA_TRANSPOSE_H
+#define LA_TRANSPOSE_H
+
+#include <stdint.h>
+
+#define LA_NB_CHANNELS 5
+
+typedef struct
+{
+    uint8_t carry[8];       /* samples left over by the last call */
+    uint32_t ncarry;
+} la_transposer;
+
+void la_transposer_init(la_transposer *t);
+
+/*
+ * Append the planes of count samples at offset pos (in bytes) of planes[0..4].
+ * Returns the number of bytes written to each plane, (ncarry + count) / 8,
+ * the samples that don't fill a byte are kept for the next call.
+ */
+uint32_t la_transpose_run(la_transposer *t, const uint8_t *samples, uint32_t count,
+                          uint8_t *const planes[LA_NB_CHANNELS], uint32_t pos);
+
+#endif /* LA_TRANSPOSE_H */
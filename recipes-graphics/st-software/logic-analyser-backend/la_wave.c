@@ -0,0 +1,152 @@
+/*
+* la_wave.c
+* Waveform frames handed from the analysis stage to the UI.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "la_wave.h"
+
+#define LA_WAVE_FRESH 0x80000000
+
+void la_wave_init(la_wave *wave, const la_wave_view *view)
+{
+    memset(wave, 0, sizeof(*wave));
+    wave->view = *view;
+    wave->front = 0;
+    wave->middle = 1;
+    wave->back = 2;
+    wave->last_seq = UINT32_MAX;
+}
+
+void la_wave_set_view(la_wave *wave, const la_wave_view *view)
+{
+    uint32_t seq = wave->view_seq;
+
+    __atomic_store_n(&wave->view_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    wave->view = *view;
+    __atomic_store_n(&wave->view_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static uint32_t la_wave_get_view(la_wave *wave, la_wave_view *view)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&wave->view_seq, __ATOMIC_ACQUIRE);
+        *view = wave->view;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&wave->view_seq, __ATOMIC_RELAXED));
+    return seq;
+}
+
+const la_wave_frame *la_wave_acquire(la_wave *wave)
+{
+    if (!(__atomic_load_n(&wave->middle, __ATOMIC_ACQUIRE) & LA_WAVE_FRESH))
+        return NULL;
+    wave->front = __atomic_exchange_n(&wave->middle, wave->front, __ATOMIC_ACQ_REL) & ~LA_WAVE_FRESH;
+    return &wave->frame[wave->front];
+}
+
+// samples the viewport can be rendered from at this span
+static uint64_t la_wave_available(uint64_t span, const la_index *idx, const la_pyramid *pyr)
+{
+    if (span >= LA_PYRAMID_BASE)
+        return pyr->samples & ~(uint64_t)(LA_PYRAMID_BASE - 1);
+    return idx->complete;
+}
+
+int la_wave_pending(la_wave *wave, int *view_changed, const la_index *idx, const la_pyramid *pyr)
+{
+    la_wave_view view;
+    uint64_t samples;
+
+    *view_changed = la_wave_get_view(wave, &view) != wave->last_seq;
+    if (*view_changed)
+        return 1;
+    // nobody is looking
+    if (view.ncols == 0)
+        return 0;
+    samples = la_wave_available(view.span, idx, pyr);
+    if (samples == wave->last_samples)
+        return 0;
+    // a capture restarted, or new samples after the last column drawn
+    return samples < wave->last_samples || view.follow || !wave->last_full;
+}
+
+// exact picture from the transitions, for columns shorter than a pyramid cell
+static uint32_t la_wave_from_index(const la_index *idx, la_wave_frame *frame)
+{
+    uint64_t from, pos;
+    uint32_t col;
+    uint8_t levels;
+    int c;
+
+    for (col = 0; col < frame->ncols; col++) {
+        from = frame->start + col * frame->span;
+        if (la_index_level_at(idx, from, &levels) < 0)
+            break;
+        frame->cell[col] = 0;
+        for (c = 0; c < LA_NB_CHANNELS; c++) {
+            if (la_index_next_edge(idx, c, from, LA_EDGE_ANY, &pos) == 0 &&
+                pos < from + frame->span)
+                frame->cell[col] |= LA_PYR_LOW(c) | LA_PYR_HIGH(c);
+            else
+                frame->cell[col] |= (levels >> c) & 1 ? LA_PYR_HIGH(c) : LA_PYR_LOW(c);
+        }
+    }
+    memset(&frame->cell[col], 0, (frame->ncols - col) * sizeof(frame->cell[0]));
+    return col;
+}
+
+void la_wave_render(la_wave *wave, const la_index *idx, const la_pyramid *pyr)
+{
+    la_wave_frame *frame;
+    la_wave_view view;
+    uint64_t samples, page;
+    uint32_t seq;
+
+    seq = la_wave_get_view(wave, &view);
+    if (view.span == 0)
+        view.span = 1;
+    if (view.ncols > LA_WAVE_MAX_COLS)
+        view.ncols = LA_WAVE_MAX_COLS;
+    samples = la_wave_available(view.span, idx, pyr);
+    if (view.follow && view.ncols) {
+        // the page holding the last sample
+        page = view.span * view.ncols;
+        view.start = samples ? (samples - 1) / page * page : 0;
+    }
+
+    frame = &wave->frame[wave->back];
+    frame->start = view.start;
+    frame->span = view.span;
+    frame->ncols = view.ncols;
+    frame->view_seq = seq;
+    if (view.span >= LA_PYRAMID_BASE)
+        frame->valid = la_pyramid_render(pyr, view.start, view.span, view.ncols, frame->cell);
+    else
+        frame->valid = la_wave_from_index(idx, frame);
+    wave->last_seq = seq;
+    wave->last_samples = samples;
+    wave->last_full = frame->valid == frame->ncols;
+    wave->back = __atomic_exchange_n(&wave->middle, wave->back | LA_WAVE_FRESH, __ATOMIC_ACQ_REL) & ~LA_WAVE_FRESH;
+}
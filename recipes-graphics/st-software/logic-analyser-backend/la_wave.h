@@ -0,0 +1,90 @@
+/*
+* la_wave.h
+* Waveform frames handed from the analysis stage to the UI.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+/*
+ * The UI sets the viewport (first sample, samples per column, number of
+ * columns) and the analysis stage, which owns the index and the pyramid,
+ * renders it into a frame of one cell per column (LA_PYR_* bits, see
+ * la_pyramid.h). The UI only turns the cells into pixels.
+ *
+ * The viewport is published through a sequence lock, the UI being its only
+ * writer. The frames go through a triple buffer: the analysis fills the back
+ * one and swaps it with the middle one, the UI swaps the middle one with the
+ * front one when it is newer, neither side ever waits for the other.
+ *
+ * In follow mode the analysis moves the viewport a page at a time so that
+ * the last samples are visible, the UI then only has to draw the columns that
+ * were added since the previous frame.
+ */
+
+#ifndef LA_WAVE_H
+#define LA_WAVE_H
+
+#include <stdint.h>
+#include "la_index.h"
+#include "la_pyramid.h"
+
+#define LA_WAVE_MAX_COLS 2048
+
+typedef struct
+{
+    uint64_t start;         /* sample of the first column */
+    uint64_t span;          /* samples per column */
+    uint32_t ncols;
+    uint32_t follow;        /* keep the last samples in view */
+} la_wave_view;
+
+typedef struct
+{
+    uint64_t start;         /* viewport actually rendered, follow mode applied */
+    uint64_t span;
+    uint32_t ncols;
+    uint32_t valid;         /* columns holding data, the others are 0 */
+    uint32_t view_seq;      /* viewport version the frame was rendered for */
+    uint16_t cell[LA_WAVE_MAX_COLS];
+} la_wave_frame;
+
+typedef struct
+{
+    uint32_t view_seq;      /* odd while the UI updates view */
+    la_wave_view view;
+    la_wave_frame frame[3];
+    uint32_t middle;        /* frame index, LA_WAVE_FRESH if not taken yet */
+    uint32_t back;          /* owned by the analysis */
+    uint32_t front;         /* owned by the UI */
+    uint32_t last_seq;      /* viewport and data of the last frame rendered */
+    uint64_t last_samples;
+    uint32_t last_full;     /* it had data in all its columns */
+} la_wave;
+
+void la_wave_init(la_wave *wave, const la_wave_view *view);
+
+/* UI side */
+void la_wave_set_view(la_wave *wave, const la_wave_view *view);
+/* newest frame if there is one the UI hasn't seen, NULL otherwise */
+const la_wave_frame *la_wave_acquire(la_wave *wave);
+
+/* analysis side: 1 if the viewport changed, or if new samples fall into it */
+int la_wave_pending(la_wave *wave, int *view_changed, const la_index *idx, const la_pyramid *pyr);
+void la_wave_render(la_wave *wave, const la_index *idx, const la_pyramid *pyr);
+
+#endif /* LA_WAVE_H */
@@ -0,0 +1,549 @@
+/*
+* la_writer.c
+* Capture to disk stage of the logic analyser backend.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+
+/*
+ * The SDB buffers are not copied: the acquisition thread only queues a
+ * descriptor per completion, and the writer thread splices the completions
+ * from its own read-only session on the SDB device (see la_writer_open()).
+ * The driver moves references to the buffer pages through a pipe into the
+ * file, O_DIRECT included: unlike the userland PFN mapping of the pool, the
+ * pages the driver hands out can be used for direct I/O. The price is that a
+ * buffer only goes back to the M4 once it is on the card, the M4 may run out
+ * of buffers when the card stalls for longer than the pool lasts.
+ *
+ * The other data (tty0, or the SDB buffers when the device can't be spliced)
+ * is staged in a few large chunks, page aligned so that they can be written
+ * with O_DIRECT: the page cache is bypassed and the eMMC / SD card sees long
+ * sequential writes. The chunks circulate between the acquisition thread,
+ * which fills one at a time, and the writer thread through two lock-free
+ * queues: mFull carries the chunks to write, mFree brings them back. Up to
+ * WRITER_NB_CHUNKS - 1 full chunks absorb the card write latency spikes.
+ *
+ * The writer thread lives as long as the backend. Opening and closing a file
+ * are descriptors queued in mFull with the chunks, so the acquisition thread
+ * never waits for the backlog to reach the card: a file is closed by the
+ * writer thread once its last chunk is written, while the next capture may
+ * already be queueing data for the following file.
+ */
+
+#define _GNU_SOURCE             /* O_DIRECT, fallocate */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "la_queue.h"
+#include "la_writer.h"
+
+#define WRITER_CHUNK_SIZE (4*1024*1024)
+#define WRITER_NB_CHUNKS 8              /* 32MB, about 2.5s at 12MHz, power of 2 */
+#define WRITER_QUEUE_ENTRIES 64         /* chunks, completions, open / close, power of 2 */
+#define WRITER_ALIGN 4096
+#define WRITER_PREALLOC_STEP (64*1024*1024)
+#define WRITER_PIPE_SIZE (1024*1024)    /* a whole SDB buffer per splice */
+
+/* descriptors queued in mFull */
+#define WRITER_DESC_CHUNK 1             /* id: staging chunk, size: bytes to write */
+#define WRITER_DESC_OPEN 2              /* id: file descriptor, flags: device or -1, seq: file generation */
+#define WRITER_DESC_CLOSE 3
+#define WRITER_DESC_EXIT 4
+#define WRITER_DESC_SPLICE 5            /* size: bytes of the next completions of the device */
+
+static pthread_t threadWriter;
+static uint8_t mRunning;
+static sem_t mFullSem;                  /* number of descriptors queued in mFull */
+
+static unsigned char *mChunk[WRITER_NB_CHUNKS];
+static la_spsc mFull, mFree;
+static la_desc mFullSlot[WRITER_QUEUE_ENTRIES], mFreeSlot[WRITER_NB_CHUNKS];
+
+/* owned by the acquisition thread */
+static uint8_t mOpen, mSplicing;
+static la_desc mCur;                    /* chunk being filled, valid if mHasCur */
+static uint8_t mHasCur;
+static uint32_t mBacklogMaxLocal;
+
+/* owned by the writer thread */
+static int mFd = -1;
+static int mSrc = -1;                   /* SDB device the completions are spliced from */
+static int mPipe[2] = {-1, -1};
+static uint32_t mFdGen;
+static uint64_t mOffset, mAllocated;
+static uint64_t mFileStartNs;
+
+/*
+ * Single writer each, read by la_writer_get_stats() from any thread.
+ * mSubmitted and mRetired (written or discarded) count since the start, the
+ * others are about one file: the generations tell whether they are about the
+ * current one or a previous one still being drained.
+ */
+static uint64_t mSubmitted, mRetired, mWritten, mDropped;
+static uint32_t mBacklogMax;
+static uint32_t mGen, mWrittenGen, mErrorGen, mStopGen;
+static int mError;
+static uint64_t mStartNs, mStopNs;
+
+static uint64_t la_writer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// make room on the card ahead of the writes, so that the file doesn't fragment
+static void la_writer_prealloc(uint64_t end)
+{
+    if (end <= mAllocated)
+        return;
+    if (fallocate(mFd, 0, mAllocated, WRITER_PREALLOC_STEP) < 0) {
+        if (errno == EOPNOTSUPP)
+            printf("CA7 : writer => no preallocation on this file system\n");
+        else
+            printf("CA7 : writer => preallocation failed, err=-%d\n", errno);
+        mAllocated = UINT64_MAX;
+        return;
+    }
+    mAllocated += WRITER_PREALLOC_STEP;
+}
+
+static int la_writer_write(const unsigned char *data, uint32_t len)
+{
+    // O_DIRECT writes must cover whole blocks, the last chunk is padded and
+    // the file truncated to its real size when closed
+    uint32_t size = (len + WRITER_ALIGN - 1) & ~(WRITER_ALIGN - 1);
+    uint32_t done = 0;
+    ssize_t ret;
+
+    la_writer_prealloc(mOffset + size);
+    while (done < size) {
+        ret = pwrite(mFd, data + done, size - done, mOffset + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && (fcntl(mFd, F_GETFL) & O_DIRECT)) {
+                // the file system refuses direct I/O, go through the page cache
+                printf("CA7 : writer => O_DIRECT refused, using buffered writes\n");
+                fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+            return -errno;
+        }
+        done += ret;
+    }
+    mOffset += len;
+    return 0;
+}
+
+// move the next len bytes of completions from the device to the file
+static int la_writer_splice(uint32_t len)
+{
+    loff_t off;
+    ssize_t in, out;
+
+    while (len) {
+        // the pipe is empty, the device hands out as much of a completion as fits
+        in = splice(mSrc, NULL, mPipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in < 0 && errno == EINTR)
+            continue;
+        if (in <= 0) {
+            if (in < 0 && errno != EAGAIN)
+                return -errno;
+            // not in our ring: dropped by the driver while it was full
+            printf("CA7 : writer => %u bytes missing from the SDB device\n", len);
+            return 0;
+        }
+        len -= in;
+        la_writer_prealloc(mOffset + in);
+        while (in) {
+            off = mOffset;
+            out = splice(mPipe[0], NULL, mFd, &off, in, SPLICE_F_MOVE);
+            if (out < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL && (fcntl(mFd, F_GETFL) & O_DIRECT)) {
+                    // refused, or a completion that isn't a multiple of the block size
+                    printf("CA7 : writer => O_DIRECT refused, using buffered writes\n");
+                    fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) & ~O_DIRECT);
+                    continue;
+                }
+                return -errno;
+            }
+            mOffset += out;
+            in -= out;
+        }
+    }
+    return 0;
+}
+
+static void la_writer_close_src(void)
+{
+    if (mSrc < 0)
+        return;
+    // gives the completions still held back to the M4, with the pages in the pipe
+    close(mSrc);
+    close(mPipe[0]);
+    close(mPipe[1]);
+    mSrc = mPipe[0] = mPipe[1] = -1;
+}
+
+// a write error of the file being written, the rest of its data is discarded
+static int la_writer_failed(void)
+{
+    return __atomic_load_n(&mErrorGen, __ATOMIC_ACQUIRE) == mFdGen &&
+        __atomic_load_n(&mError, __ATOMIC_RELAXED);
+}
+
+static void la_writer_fail(int err)
+{
+    printf("CA7 : writer => write failed, err=%d\n", err);
+    __atomic_store_n(&mError, -err, __ATOMIC_RELAXED);
+    __atomic_store_n(&mErrorGen, mFdGen, __ATOMIC_RELEASE);
+    // the rest of the file is discarded, don't keep the M4 waiting for it
+    la_writer_close_src();
+}
+
+static void la_writer_do_open(const la_desc *desc)
+{
+    mFd = desc->id;
+    mFdGen = desc->seq;
+    mSrc = (int)desc->flags;
+    if (mSrc >= 0) {
+        if (pipe2(mPipe, O_CLOEXEC) < 0) {
+            mPipe[0] = mPipe[1] = -1;
+            la_writer_fail(-errno);
+        } else {
+            // best effort, smaller pipes only cost more splice calls
+            fcntl(mPipe[1], F_SETPIPE_SZ, WRITER_PIPE_SIZE);
+        }
+    }
+    mOffset = mAllocated = 0;
+    mFileStartNs = la_writer_now();
+    __atomic_store_n(&mWritten, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mWrittenGen, mFdGen, __ATOMIC_RELEASE);
+}
+
+// the last data of the file is written, finish it on this thread
+static void la_writer_do_close(void)
+{
+    uint64_t written = mOffset, stop;
+
+    if (mFd < 0)
+        return;
+    la_writer_close_src();
+    // drop the padding of the last chunk and the preallocated blocks
+    if (ftruncate(mFd, mOffset) < 0)
+        printf("CA7 : writer => truncate failed, err=-%d\n", errno);
+    if (close(mFd) < 0 && !la_writer_failed())
+        la_writer_fail(-errno);
+    mFd = -1;
+    stop = la_writer_now();
+    __atomic_store_n(&mStopNs, stop, __ATOMIC_RELAXED);
+    __atomic_store_n(&mStopGen, mFdGen, __ATOMIC_RELEASE);
+    printf("CA7 : writer => %" PRIu64 " bytes written at %.1f MB/s%s\n", written,
+        stop > mFileStartNs ? written * 1e9 / (stop - mFileStartNs) / (1024 * 1024) : 0,
+        la_writer_failed() ? ", write error" : "");
+}
+
+static void *la_writer_thread(void *arg)
+{
+    la_desc desc;
+    uint64_t offset;
+    int ret;
+
+    while (1) {
+        while (sem_wait(&mFullSem) < 0 && errno == EINTR)
+            ;
+        if (la_spsc_pop(&mFull, &desc) < 0)
+            continue;
+        switch (desc.type) {
+        case WRITER_DESC_CHUNK:
+            if (mFd >= 0 && !la_writer_failed()) {
+                ret = la_writer_write(mChunk[desc.id], desc.size);
+                if (ret < 0)
+                    la_writer_fail(ret);
+                else
+                    __atomic_store_n(&mWritten, mWritten + desc.size, __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&mRetired, mRetired + desc.size, __ATOMIC_RELEASE);
+            desc.size = 0;
+            la_spsc_push(&mFree, &desc);
+            break;
+        case WRITER_DESC_SPLICE:
+            if (mFd >= 0 && !la_writer_failed()) {
+                offset = mOffset;
+                ret = la_writer_splice(desc.size);
+                if (ret < 0)
+                    la_writer_fail(ret);
+                else
+                    __atomic_store_n(&mWritten, mWritten + (mOffset - offset), __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&mRetired, mRetired + desc.size, __ATOMIC_RELEASE);
+            break;
+        case WRITER_DESC_OPEN:
+            la_writer_do_open(&desc);
+            break;
+        case WRITER_DESC_CLOSE:
+            la_writer_do_close();
+            break;
+        case WRITER_DESC_EXIT:
+            la_writer_do_close();
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// hand a descriptor over to the writer thread
+static int la_writer_post(uint32_t type, uint32_t id, uint32_t size, uint32_t flags)
+{
+    la_desc desc;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.type = type;
+    desc.id = id;
+    desc.size = size;
+    desc.flags = flags;
+    desc.seq = mGen;
+    if (la_spsc_push(&mFull, &desc) < 0)
+        return -1;
+    sem_post(&mFullSem);
+    return 0;
+}
+
+int la_writer_init(void)
+{
+    la_desc chunk;
+    int i;
+
+    la_spsc_init(&mFull, mFullSlot, WRITER_QUEUE_ENTRIES);
+    la_spsc_init(&mFree, mFreeSlot, WRITER_NB_CHUNKS);
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.type = WRITER_DESC_CHUNK;
+    for (i = 0; i < WRITER_NB_CHUNKS; i++) {
+        if (posix_memalign((void **)&mChunk[i], WRITER_ALIGN, WRITER_CHUNK_SIZE)) {
+            printf("CA7 : writer => failed to allocate the staging chunks\n");
+            return -ENOMEM;
+        }
+        chunk.id = i;
+        la_spsc_push(&mFree, &chunk);
+    }
+    sem_init(&mFullSem, 0, 0);
+    if (pthread_create(&threadWriter, NULL, la_writer_thread, NULL) != 0) {
+        printf("CA7 : writer => thread creation fails\n");
+        return -EAGAIN;
+    }
+    mRunning = 1;
+    return 0;
+}
+
+void la_writer_exit(void)
+{
+    if (!mRunning)
+        return;
+    la_writer_close();
+    // the queue always keeps room for it, see la_writer_open()
+    la_writer_post(WRITER_DESC_EXIT, 0, 0, 0);
+    pthread_join(threadWriter, NULL);
+    sem_destroy(&mFullSem);
+    mRunning = 0;
+}
+
+int la_writer_open(const char *path, int spliceFd)
+{
+    int fd;
+
+    if (!mRunning || mOpen) {
+        fd = mRunning ? -EBUSY : -ENODEV;
+        goto err;
+    }
+    // the open, its close and the final exit must always fit in the queue,
+    // whatever is still queued for the previous files
+    if (la_spsc_count(&mFull) + WRITER_NB_CHUNKS + 3 > WRITER_QUEUE_ENTRIES) {
+        printf("CA7 : writer => previous recordings still being written\n");
+        fd = -EBUSY;
+        goto err;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fd = -errno;
+        printf("CA7 : writer => Error opening %s, err=%d\n", path, fd);
+        goto err;
+    }
+    __atomic_store_n(&mDropped, 0, __ATOMIC_RELAXED);
+    mBacklogMaxLocal = 0;
+    __atomic_store_n(&mBacklogMax, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mStartNs, la_writer_now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&mGen, mGen + 1, __ATOMIC_RELEASE);
+    la_writer_post(WRITER_DESC_OPEN, fd, 0, spliceFd);
+    mOpen = 1;
+    mSplicing = spliceFd >= 0;
+    printf("CA7 : writer => recording to %s%s\n", path, mSplicing ? ", spliced from the SDB device" : "");
+    return 0;
+
+err:
+    if (spliceFd >= 0)
+        close(spliceFd);
+    return fd;
+}
+
+int la_writer_is_open(void)
+{
+    return mOpen;
+}
+
+// the writer thread failed to write the current file
+static int la_writer_error(void)
+{
+    return __atomic_load_n(&mErrorGen, __ATOMIC_ACQUIRE) == mGen ?
+        __atomic_load_n(&mError, __ATOMIC_RELAXED) : 0;
+}
+
+// hand the chunk being filled over to the writer thread
+static void la_writer_push_cur(void)
+{
+    // can't fail, the queue has room for all the chunks
+    la_spsc_push(&mFull, &mCur);
+    sem_post(&mFullSem);
+    mHasCur = 0;
+}
+
+// account for a submission accepted by la_writer_submit() or la_writer_splice_next()
+static void la_writer_accepted(uint32_t size)
+{
+    uint32_t backlog;
+
+    __atomic_store_n(&mSubmitted, mSubmitted + size, __ATOMIC_RELEASE);
+    backlog = mSubmitted - __atomic_load_n(&mRetired, __ATOMIC_ACQUIRE);
+    if (backlog > mBacklogMaxLocal) {
+        mBacklogMaxLocal = backlog;
+        __atomic_store_n(&mBacklogMax, backlog, __ATOMIC_RELAXED);
+    }
+}
+
+int la_writer_submit(const void *data, uint32_t size)
+{
+    const unsigned char *src = data;
+    uint32_t space, n;
+
+    if (!mOpen)
+        return -EBADF;
+    if (la_writer_error())
+        return -EIO;
+    // the chunk being filled and the free ones, a submission is never split
+    // between the file and the floor
+    space = la_spsc_count(&mFree) * WRITER_CHUNK_SIZE;
+    if (mHasCur)
+        space += WRITER_CHUNK_SIZE - mCur.size;
+    if (size > space) {
+        __atomic_store_n(&mDropped, mDropped + size, __ATOMIC_RELEASE);
+        return -ENOSPC;
+    }
+    la_writer_accepted(size);
+
+    while (size) {
+        if (!mHasCur) {
+            la_spsc_pop(&mFree, &mCur);
+            mHasCur = 1;
+        }
+        n = WRITER_CHUNK_SIZE - mCur.size;
+        if (n > size)
+            n = size;
+        memcpy(mChunk[mCur.id] + mCur.size, src, n);
+        mCur.size += n;
+        src += n;
+        size -= n;
+        if (mCur.size == WRITER_CHUNK_SIZE)
+            la_writer_push_cur();
+    }
+    return 0;
+}
+
+int la_writer_splice_next(uint32_t size)
+{
+    if (!mOpen)
+        return -EBADF;
+    if (!mSplicing)
+        return -ENODEV;
+    if (la_writer_error())
+        return -EIO;
+    // keep room for the chunks, the close and the exit; with credits, the M4
+    // can't complete more buffers than the pool holds before they are spliced
+    if (la_spsc_count(&mFull) + WRITER_NB_CHUNKS + 2 >= WRITER_QUEUE_ENTRIES) {
+        __atomic_store_n(&mDropped, mDropped + size, __ATOMIC_RELEASE);
+        return -ENOSPC;
+    }
+    la_writer_accepted(size);
+    // the staged data comes first in the file
+    if (mHasCur && mCur.size)
+        la_writer_push_cur();
+    la_writer_post(WRITER_DESC_SPLICE, 0, size, 0);
+    return 0;
+}
+
+int la_writer_close(void)
+{
+    la_writer_stats stats;
+
+    if (!mOpen)
+        return 0;
+    if (mHasCur && mCur.size)
+        la_writer_push_cur();
+    // room kept by la_writer_open(), the writer thread closes the file once
+    // its backlog is on the card
+    la_writer_post(WRITER_DESC_CLOSE, 0, 0, 0);
+    mOpen = 0;
+    la_writer_get_stats(&stats);
+    printf("CA7 : writer => closing, %" PRIu64 " bytes dropped, backlog %u kB (max %u kB)\n",
+        stats.dropped, stats.backlog / 1024, stats.backlog_max / 1024);
+    return stats.error ? -stats.error : 0;
+}
+
+void la_writer_get_stats(la_writer_stats *stats)
+{
+    uint32_t gen = __atomic_load_n(&mGen, __ATOMIC_ACQUIRE);
+    uint64_t start, stop;
+
+    // nothing written yet while the writer thread is still on the previous file
+    stats->written = __atomic_load_n(&mWrittenGen, __ATOMIC_ACQUIRE) == gen ?
+        __atomic_load_n(&mWritten, __ATOMIC_ACQUIRE) : 0;
+    stats->dropped = __atomic_load_n(&mDropped, __ATOMIC_RELAXED);
+    stats->backlog = __atomic_load_n(&mSubmitted, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&mRetired, __ATOMIC_ACQUIRE);
+    stats->backlog_max = __atomic_load_n(&mBacklogMax, __ATOMIC_RELAXED);
+    stats->error = __atomic_load_n(&mErrorGen, __ATOMIC_ACQUIRE) == gen ?
+        __atomic_load_n(&mError, __ATOMIC_RELAXED) : 0;
+    start = __atomic_load_n(&mStartNs, __ATOMIC_RELAXED);
+    stop = __atomic_load_n(&mStopGen, __ATOMIC_ACQUIRE) == gen ?
+        __atomic_load_n(&mStopNs, __ATOMIC_RELAXED) : la_writer_now();
+    stats->rate_MBps = stop > start ? stats->written * 1e9 / (stop - start) / (1024 * 1024) : 0;
+}
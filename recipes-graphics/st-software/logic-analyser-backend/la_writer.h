@@ -0,0 +1,69 @@
+/*
+* la_writer.h
+* Capture to disk stage of the logic analyser backend.
+*
+* Copyright (C) 2019, STMicroelectronics - All Rights Reserved
+*
+* License type: GPLv2
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published by
+* the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* this program. If not, see
+* http://www.gnu.org/licenses/.
+*/
+
+#ifndef LA_WRITER_H
+#define LA_WRITER_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t written;       /* bytes on disk */
+    uint64_t dropped;       /* bytes refused because the backlog was full */
+    uint32_t backlog;       /* bytes accepted but not on disk yet */
+    uint32_t backlog_max;   /* highest backlog since the file was opened */
+    double rate_MBps;       /* sustained rate since the file was opened */
+    int error;              /* errno of the first write failure, 0 if none */
+} la_writer_stats;
+
+/*
+ * la_writer_init() starts the writer thread, la_writer_exit() closes the
+ * file and waits until everything queued is on the card: call it from the
+ * main thread once the acquisition thread is gone, never from the event loop.
+ * The other functions but la_writer_get_stats() must be called from the same
+ * thread, the acquisition one, and never block: la_writer_submit() copies
+ * the data into a staging chunk and la_writer_close() only queues the end of
+ * the file, both are written and closed by the writer own thread.
+ */
+int la_writer_init(void);
+void la_writer_exit(void);
+/*
+ * spliceFd is a session of the SDB device attached read-only to the pool
+ * with its own completion ring, or -1: the writer owns it from now on and
+ * closes it with the file. Returns -EBUSY while the previous files still
+ * fill the queue.
+ */
+int la_writer_open(const char *path, int spliceFd);
+int la_writer_is_open(void);
+/* returns -ENOSPC if the backlog is full (data dropped), -EIO once a write failed */
+int la_writer_submit(const void *data, uint32_t size);
+/*
+ * Record the next size bytes completed in the ring of spliceFd, one call per
+ * completion in ring order. Returns -ENODEV if the file was opened without a
+ * device to splice from, else as la_writer_submit().
+ */
+int la_writer_splice_next(uint32_t size);
+/* returns the error of a write already failed, the last ones are only printed */
+int la_writer_close(void);
+void la_writer_get_stats(la_writer_stats *stats);
+
+#endif /* LA_WRITER_H */
@@ -14,7 +14,27 @@
 #include <linux/miscdevice.h>
 #include <linux/eventfd.h>
 #include <linux/of_platform.h>
-#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/ctype.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/refcount.h>
+#include <linux/kthread.h>
+#include <linux/firmware.h>
+#include <linux/hrtimer.h>
 
 #define RPMSG_SDB_DRIVER_VERSION "1.0"
 
@@ -23,7 +43,49 @@
  */
 static const char rpmsg_sdb_driver_name[] = "stm32-rpmsg-sdb";
 
-static int LastBufferId;
+/* Instance numbers, one /dev/rpmsg-sdb<n> per rpmsg channel */
+static DEFINE_IDA(rpmsg_sdb_ida);
+
+/* Max number of buffers, ids index the buffer table directly */
+#define RPMSG_SDB_MAX_BUFFERS 256
+
+/* Pool preallocated at probe, so that it survives the capture restarts */
+static unsigned int pool_count;
+module_param(pool_count, uint, 0444);
+MODULE_PARM_DESC(pool_count, "Number of buffers of the pool preallocated at probe (0: none)");
+
+static unsigned int pool_size;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Size of each buffer of the pool preallocated at probe");
+
+static bool pool_cached;
+module_param(pool_cached, bool, 0444);
+MODULE_PARM_DESC(pool_cached, "Cacheable mapping of the pool preallocated at probe");
+
+/* Loopback instances, a kernel thread plays the copro to run without the hardware */
+static unsigned int loopback;
+module_param(loopback, uint, 0444);
+MODULE_PARM_DESC(loopback, "Number of loopback instances created at load (0: none)");
+
+static unsigned int loopback_rate = 100;
+module_param(loopback_rate, uint, 0644);
+MODULE_PARM_DESC(loopback_rate, "Completions per second of the loopback instances (0: as fast as possible)");
+
+static unsigned int loopback_size;
+module_param(loopback_size, uint, 0644);
+MODULE_PARM_DESC(loopback_size, "Size of the loopback completions (0: whole buffer)");
+
+static char *loopback_pattern = "memset";
+module_param(loopback_pattern, charp, 0444);
+MODULE_PARM_DESC(loopback_pattern, "Loopback data: memset, counter or dump");
+
+static char *loopback_dump = "rpmsg-sdb-dump.bin";
+module_param(loopback_dump, charp, 0444);
+MODULE_PARM_DESC(loopback_dump, "Firmware file replayed by the dump pattern");
+
+static bool loopback_credits = true;
+module_param(loopback_credits, bool, 0644);
+MODULE_PARM_DESC(loopback_credits, "Loopback waits for the buffer credits (else overwrites, causing overruns)");
 
 struct rpmsg_sdb_ioctl_set_efd {
 	int bufferId, eventfd;
@@ -34,32 +96,287 @@ struct rpmsg_sdb_ioctl_get_data_size {
 	uint32_t size;
 };
 
+struct rpmsg_sdb_ioctl_setup_ring {
+	uint32_t entries; /* number of ring entries, power of 2 */
+	int eventfd; /* signalled when an entry is posted in an empty ring */
+};
+
+struct rpmsg_sdb_ioctl_set_map_mode {
+	uint32_t cached; /* map the next buffers cacheable, CPU access must then be bracketed */
+};
+
+struct rpmsg_sdb_ioctl_cpu_access {
+	int bufferId;
+};
+
+struct rpmsg_sdb_ioctl_alloc_pool {
+	uint32_t count; /* number of buffers */
+	uint32_t size; /* size of each buffer, rounded up to pages on return */
+	uint32_t flags; /* RPMSG_SDB_POOL_xxx */
+};
+
+#define RPMSG_SDB_POOL_CACHED	0x1 /* cacheable mapping, see SET_MAP_MODE */
+
+struct rpmsg_sdb_ioctl_release_buffer {
+	int bufferId;
+};
+
+struct rpmsg_sdb_ioctl_attach {
+	uint32_t count; /* number of buffers of the pool */
+	uint32_t size; /* size of each buffer */
+	uint32_t flags; /* RPMSG_SDB_POOL_xxx */
+};
+
+struct rpmsg_sdb_ioctl_export_dmabuf {
+	int bufferId; /* pool buffer, or -1 for the whole pool */
+	int fd; /* dma-buf file descriptor, returned */
+};
+
 /* ioctl numbers */
 /* _IOW means userland is writing and kernel is reading */
 /* _IOR means userland is reading and kernel is writing */
 /* _IOWR means userland and kernel can both read and write */
 #define RPMSG_SDB_IOCTL_SET_EFD _IOW('R', 0x00, struct rpmsg_sdb_ioctl_set_efd *)
 #define RPMSG_SDB_IOCTL_GET_DATA_SIZE _IOWR('R', 0x01, struct rpmsg_sdb_ioctl_get_data_size *)
+#define RPMSG_SDB_IOCTL_SETUP_RING _IOW('R', 0x02, struct rpmsg_sdb_ioctl_setup_ring *)
+#define RPMSG_SDB_IOCTL_SET_MAP_MODE _IOW('R', 0x03, struct rpmsg_sdb_ioctl_set_map_mode *)
+#define RPMSG_SDB_IOCTL_BEGIN_CPU_ACCESS _IOW('R', 0x04, struct rpmsg_sdb_ioctl_cpu_access *)
+#define RPMSG_SDB_IOCTL_END_CPU_ACCESS _IOW('R', 0x05, struct rpmsg_sdb_ioctl_cpu_access *)
+#define RPMSG_SDB_IOCTL_ALLOC_POOL _IOWR('R', 0x06, struct rpmsg_sdb_ioctl_alloc_pool *)
+#define RPMSG_SDB_IOCTL_RELEASE_BUFFER _IOW('R', 0x07, struct rpmsg_sdb_ioctl_release_buffer *)
+#define RPMSG_SDB_IOCTL_ATTACH _IOR('R', 0x08, struct rpmsg_sdb_ioctl_attach *)
+#define RPMSG_SDB_IOCTL_EXPORT_DMABUF _IOWR('R', 0x09, struct rpmsg_sdb_ioctl_export_dmabuf *)
+
+/*
+ * Buffer ownership
+ *
+ * A buffer announced to the copro is owned by the copro until its completion,
+ * then by userland until it is released, with RPMSG_SDB_IOCTL_RELEASE_BUFFER
+ * or (legacy) RPMSG_SDB_IOCTL_GET_DATA_SIZE. The release returns the buffer
+ * to the copro as a credit, with the binary protocol only: legacy firmware
+ * doesn't wait for credits. A completion of a buffer still owned by userland
+ * means that the copro has overwritten data not consumed yet: it is counted
+ * as an overrun and flagged in the ring entry.
+ *
+ * Readers
+ *
+ * Other files opened on the same device can attach to the pool with
+ * RPMSG_SDB_IOCTL_ATTACH, map it read-only and get the completions in their
+ * own ring. Each completion is held by the session owning the buffers and by
+ * every reader with a ring, and the buffer goes back to the copro when the
+ * last of them has released it.
+ *
+ * dma-buf export
+ *
+ * A pool buffer, or the whole pool, can be exported as a dma-buf with
+ * RPMSG_SDB_IOCTL_EXPORT_DMABUF, to be handed to other drivers or processes
+ * without copies. The dma-buf is read-only for readers. It keeps the pool
+ * alive, and from being reallocated, until it is released. Its CPU access
+ * ioctls (DMA_BUF_IOCTL_SYNC) do the cache maintenance of cached pools.
+ *
+ * splice
+ *
+ * With a cached pool, splice() from the device consumes the completion ring
+ * of the session in the kernel and moves references to the buffer pages into
+ * the pipe, so captures go to a file or a socket without being copied by the
+ * CPU. The buffer is held until the last of its pages leaves the pipe, then
+ * released as with RPMSG_SDB_IOCTL_RELEASE_BUFFER. The device is readable
+ * (poll) while the ring isn't empty.
+ */
+
+/*
+ * Buffer pool
+ *
+ * A single contiguous CMA region split in buffers of the same size, allocated
+ * by RPMSG_SDB_IOCTL_ALLOC_POOL (or at probe, see the pool_xxx parameters)
+ * and mapped at once at RPMSG_SDB_POOL_MMAP_OFFSET, buffer i starting at
+ * offset i * size. The pool is kept when the device is closed and reused by
+ * the next ALLOC_POOL with the same geometry.
+ */
+#define RPMSG_SDB_POOL_MMAP_OFFSET 0x20000000UL
+
+/*
+ * Completion ring
+ *
+ * Shared with userland by a mmap at RPMSG_SDB_RING_MMAP_OFFSET. The driver
+ * posts an entry per completed buffer and moves the producer index, userland
+ * drains the entries and moves the consumer index, so any number of
+ * completions is handled without syscall. The eventfd is only signalled when
+ * an entry is posted while the consumer has caught up with the producer,
+ * i.e. when userland may be sleeping on it: before sleeping, userland must
+ * store the consumer index, issue a full barrier and check the producer index
+ * again.
+ */
+#define RPMSG_SDB_RING_MMAP_OFFSET 0x40000000UL
+#define RPMSG_SDB_RING_MAX_ENTRIES 4096
+
+struct rpmsg_sdb_ring_entry {
+	uint32_t buffer_id; /* index of buffer */
+	uint32_t size; /* size of data written by copro */
+	uint32_t seq; /* completion sequence number */
+	uint32_t flags; /* completion flags, RPMSG_SDB_RING_F_xxx */
+	uint64_t timestamp; /* completion time, CLOCK_MONOTONIC ns */
+};
+
+#define RPMSG_SDB_RING_F_OVERRUN	0x1 /* previous data of the buffer was never released */
+
+struct rpmsg_sdb_ring {
+	uint32_t producer; /* written by the driver */
+	uint32_t pad0[15];
+	uint32_t consumer; /* written by userland */
+	uint32_t pad1[15];
+	uint32_t entries; /* number of entries */
+	uint32_t dropped; /* completions dropped because the ring was full, not held */
+	uint32_t overruns; /* completions of buffers not released by userland */
+	uint32_t pad2[13];
+	struct rpmsg_sdb_ring_entry entry[];
+};
+
+/*
+ * Binary descriptor protocol
+ *
+ * Fixed size little endian descriptors, several of them may be packed in the
+ * same RPMSG message. The magic byte can't be mistaken for the 'B' starting
+ * the legacy string records, so both formats are told apart on reception.
+ * The firmware advertises its protocol version with a HELLO descriptor and
+ * the driver answers with the version retained; until then (old firmware),
+ * buffers are announced with the legacy "BxAyyyyyyyyLzzzzzzzz" strings.
+ */
+#define RPMSG_SDB_DESC_MAGIC	0xa5
+#define RPMSG_SDB_DESC_VERSION	1
+
+enum rpmsg_sdb_desc_type {
+	RPMSG_SDB_DESC_HELLO = 0,	/* protocol version negotiation */
+	RPMSG_SDB_DESC_ANNOUNCE,	/* A7 -> M4: buffer address and size */
+	RPMSG_SDB_DESC_COMPLETE,	/* M4 -> A7: buffer filled with length bytes */
+	RPMSG_SDB_DESC_RELEASE,		/* A7 -> M4: buffer credit returned */
+};
+
+struct rpmsg_sdb_desc {
+	u8 magic; /* RPMSG_SDB_DESC_MAGIC */
+	u8 version; /* protocol version of the sender */
+	u8 type; /* enum rpmsg_sdb_desc_type */
+	u8 reserved;
+	__le32 flags; /* descriptor flags, RPMSG_SDB_DESC_F_xxx */
+	__le32 seq; /* sequence number, per direction */
+	__le32 buffer_id; /* index of buffer */
+	__le32 addr; /* physical address, ANNOUNCE only */
+	__le32 length; /* buffer size (ANNOUNCE) or data size (COMPLETE) */
+} __packed;
+
+#define RPMSG_SDB_DESC_F_OVERRUN	0x1 /* RELEASE: the buffer was overwritten before */
+
+enum sdb_buf_state {
+	SDB_BUF_COPRO = 0, /* announced, the copro may write it */
+	SDB_BUF_USER, /* completed, owned by userland until released */
+};
+
+/* Latency histogram buckets, bucket n counts latencies in [2^n, 2^(n+1)) us */
+#define RPMSG_SDB_LAT_BUCKETS	24
+
+struct sdb_stats_t {
+	ktime_t since; /* last reset */
+	u64 completions; /* buffers completed by the copro */
+	u64 overruns; /* completions of buffers owned by userland */
+	u64 unknown_ids; /* completions with an unknown buffer id */
+	u64 lat_count; /* completion to release latency samples */
+	u64 lat_sum; /* ns */
+	u64 lat_min; /* ns */
+	u64 lat_max; /* ns */
+	u64 lat_hist[RPMSG_SDB_LAT_BUCKETS];
+};
 
 struct sdb_buf_t {
 	int index; /* index of buffer */
 	size_t size; /* buffer size */
 	size_t writing_size; /* size of data written by copro */
+	size_t data_size; /* size of the last completion, kept for the cache syncs */
+	bool cached; /* cacheable mapping, needs explicit syncs */
+	enum dma_data_direction dir; /* of the cacheable mapping, for its syncs and free */
+	bool pooled; /* memory belongs to the pool */
+	enum sdb_buf_state state; /* current owner */
+	u32 holders; /* sessions that haven't released the last completion */
+	bool overrun; /* completed again while owned by userland */
+	ktime_t done_time; /* arrival of the last completion */
 	dma_addr_t paddr; /* physical address*/
 	void *vaddr; /* virtual address */
 	void *uaddr; /* mapped address for userland */
 	struct eventfd_ctx *efd_ctx; /* eventfd context */
-	struct list_head buflist; /* reference in the buffers list */
 };
 
+struct sdb_pool_t {
+	void *vaddr; /* virtual address */
+	dma_addr_t paddr; /* physical address */
+	size_t size; /* pool size */
+	size_t buf_size; /* size of each buffer */
+	u32 count; /* number of buffers */
+	bool cached; /* cacheable mapping */
+	enum dma_data_direction dir; /* of the cacheable mapping */
+	struct sdb_buf_t *buffers; /* buffer entries */
+	atomic_t maps; /* number of userland mappings */
+};
+
+struct rpmsg_sdb_t;
+struct sdb_splice_ref_t;
+struct sdb_loopback_t;
+
+static void rpmsg_sdb_loopback_kick(struct rpmsg_sdb_t *rpmsg_sdb);
+
+/* Per open file state */
+struct sdb_session_t {
+	struct rpmsg_sdb_t *drv; /* device the file was opened on */
+	struct list_head node; /* in the readers list of the device */
+	bool reader; /* attached read-only to the pool */
+	DECLARE_BITMAP(held, RPMSG_SDB_MAX_BUFFERS); /* completions not released yet, under lock */
+	wait_queue_head_t wait; /* woken when a completion is posted in the ring */
+	struct sdb_splice_ref_t *splice_ref; /* completion being spliced */
+	size_t splice_off; /* offset reached in this completion */
+	bool map_cached; /* next buffers are allocated with a cacheable mapping */
+	struct rpmsg_sdb_ring *ring; /* completion ring shared with userland */
+	size_t ring_size; /* ring allocation size */
+	u32 ring_entries; /* number of ring entries, not trusted from the ring */
+	u32 ring_prod; /* producer index, not trusted from the ring */
+	struct eventfd_ctx *ring_efd_ctx; /* ring eventfd context */
+};
+
+/* Per rpmsg channel state, lives until the last file is closed */
 struct rpmsg_sdb_t {
+	struct kref	kref; /* held by the rpmsg device and each open file */
 	struct mutex	mutex; /* mutex to protect the ioctls */
+	spinlock_t	lock; /* protect the buffer table against the rpmsg callback */
+	int id; /* instance number */
+	char name[16]; /* misc device name */
 	struct miscdevice mdev; /* misc device ref */
-	struct rpmsg_device	*rpdev;	/* handle rpmsg device */
-	struct list_head buffer_list; /* buffer instances list */
+	struct device *dev; /* device used for the DMA allocations */
+	struct rpmsg_device	*rpdev;	/* handle rpmsg device, NULL once removed (mutex and lock) */
+	struct sdb_loopback_t *loopback; /* fake copro instead of rpdev, NULL once removed */
+	struct sdb_session_t *owner; /* session the buffers belong to */
+	struct list_head readers; /* sessions attached to the pool */
+	struct sdb_buf_t *buffers[RPMSG_SDB_MAX_BUFFERS]; /* buffer table, indexed by id */
+	int nb_buffers; /* number of buffer entries created */
+	struct sdb_pool_t pool; /* buffer pool, if any */
+	u32 overruns; /* completions of buffers owned by userland */
+	u8 proto_version; /* 0: legacy strings, else negotiated binary version */
+	atomic_t tx_seq; /* sequence number of next descriptor sent */
+	u32 rx_seq; /* sequence number of next completion expected */
+	struct sdb_stats_t stats; /* protected by lock */
+	struct dentry *debugfs; /* debugfs directory */
 };
 
-struct device *rpmsg_sdb_dev;
+/* Look-up a buffer whose memory is allocated, called with lock held */
+static struct sdb_buf_t *rpmsg_sdb_get_buffer(struct rpmsg_sdb_t *rpmsg_sdb, int buffer_id)
+{
+	struct sdb_buf_t *buffer;
+
+	if (buffer_id < 0 || buffer_id >= rpmsg_sdb->nb_buffers)
+		return NULL;
+
+	buffer = rpmsg_sdb->buffers[buffer_id];
+	if (!buffer || !buffer->vaddr)
+		return NULL;
+
+	return buffer;
+}
 
 static int rpmsg_sdb_format_txbuf_string(struct sdb_buf_t *buffer, char *bufinfo_str, size_t bufinfo_str_size)
 {
@@ -71,58 +388,96 @@ static int rpmsg_sdb_format_txbuf_string(struct sdb_buf_t *buffer, char *bufinfo
 	return snprintf(bufinfo_str, bufinfo_str_size, "B%dA%08xL%08x", buffer->index, buffer->paddr, buffer->size);
 }
 
-static long rpmsg_sdb_decode_rxbuf_string(char *rxbuf_str, int *buffer_id, size_t *size)
+/*
+ * Decode one "BxLyyyyyyyy" record (decimal buffer id, 8 hex digits size)
+ * located at the start of rxbuf. The remote processor may coalesce several
+ * records in a single RPMSG message, so the number of consumed bytes is
+ * returned to let the caller walk the whole payload.
+ */
+static int rpmsg_sdb_decode_rxbuf_string(const char *rxbuf, int len, int *buffer_id, size_t *size)
 {
-	int ret = 0;
-	char *sub_str;
-	long bsize;
-	long bufid;
-	const char delimiter[2] = {'L','\0'};
+	int pos = 0, digits, val;
+	long bufid = 0;
+	unsigned long bsize = 0;
+
+	pr_debug("rpmsg_sdb(%s): rxbuf:%.*s\n", __func__, len, rxbuf);
+
+	if (len < 3 || rxbuf[pos] != 'B') {
+		pr_err("rpmsg_sdb(ERROR): Unexpected record start\n");
+		return -EINVAL;
+	}
+	pos++;
 
-	pr_debug("rpmsg_sdb(%s): rxbuf_str:%s\n", __func__, rxbuf_str);
+	/* Get the buffer id */
+	for (digits = 0; pos < len && isdigit(rxbuf[pos]); pos++, digits++)
+		bufid = bufid * 10 + (rxbuf[pos] - '0');
 
-	/* Get first part containing the buffer id */
-	sub_str = strsep(&rxbuf_str, delimiter);
+	if (!digits || digits > 9 || pos >= len || rxbuf[pos] != 'L') {
+		pr_err("rpmsg_sdb(ERROR): Extract of buffer id failed\n");
+		return -EINVAL;
+	}
+	pos++;
 
-	pr_debug("rpmsg_sdb(%s): sub_str:%s\n", __func__, sub_str);
+	/* Get the buffer size, at most 8 digits as next record starts with 'B' */
+	if (pos + 1 < len && rxbuf[pos] == '0' && tolower(rxbuf[pos + 1]) == 'x')
+		pos += 2;
 
-	/* Save Buffer id and size: template BxLyyyyyyyy*/
-	ret = kstrtol(&sub_str[1], 10, &bufid);
-	if (ret < 0) {
-		pr_err("rpmsg_sdb(ERROR): Extract of buffer id failed(%d)", ret);
-		goto out;
+	for (digits = 0; pos < len && digits < 8; pos++, digits++) {
+		val = hex_to_bin(rxbuf[pos]);
+		if (val < 0)
+			break;
+		bsize = (bsize << 4) | val;
 	}
 
-	ret = kstrtol(&rxbuf_str[2], 16, &bsize);
-	if (ret < 0) {
-		pr_err("rpmsg_sdb(ERROR): Extract of buffer size failed(%d)", ret);
-		goto out;
+	if (!digits) {
+		pr_err("rpmsg_sdb(ERROR): Extract of buffer size failed\n");
+		return -EINVAL;
 	}
 
 	*size = (size_t)bsize;
 	*buffer_id = (int)bufid;
 
-out:
-	return ret;
+	return pos;
 }
 
-static int rpmsg_sdb_send_buf_info(struct rpmsg_sdb_t *rpmsg_sdb, struct sdb_buf_t *buffer)
+/*
+ * Format a descriptor with the negotiated version and the next sequence
+ * number, called with lock held so that a HELLO can't reset them meanwhile
+ */
+static void rpmsg_sdb_format_txbuf_desc(struct rpmsg_sdb_t *rpmsg_sdb, struct rpmsg_sdb_desc *desc,
+					u8 type, int buffer_id, u32 addr, u32 length)
 {
-	int count = 0, ret = 0;
-	const unsigned char *tbuf;
-	char mybuf[32];
+	desc->magic = RPMSG_SDB_DESC_MAGIC;
+	desc->version = rpmsg_sdb->proto_version;
+	desc->type = type;
+	desc->reserved = 0;
+	desc->flags = 0;
+	desc->seq = cpu_to_le32(atomic_inc_return(&rpmsg_sdb->tx_seq) - 1);
+	desc->buffer_id = cpu_to_le32(buffer_id);
+	desc->addr = cpu_to_le32(addr);
+	desc->length = cpu_to_le32(length);
+}
+
+static int rpmsg_sdb_send(struct rpmsg_sdb_t *rpmsg_sdb, const void *data, int count)
+{
+	int ret = 0;
+	const unsigned char *tbuf = data;
 	int msg_size;
 	struct rpmsg_device *_rpdev;
 
+	/* The loopback copro reads the buffer states directly */
+	if (rpmsg_sdb->loopback)
+		return 0;
+
 	_rpdev = rpmsg_sdb->rpdev;
+	if (!_rpdev)
+		return -ENODEV;
+
 	msg_size = rpmsg_get_mtu(_rpdev->ept);
 
 	if (msg_size < 0)
 		return msg_size;
 
-	count = rpmsg_sdb_format_txbuf_string(buffer, mybuf, 32);
-	tbuf = &mybuf[0];
-
 	do {
 		/* send a message to our remote processor */
 		ret = rpmsg_send(_rpdev->ept, (void *)tbuf,
@@ -143,349 +498,1997 @@ static int rpmsg_sdb_send_buf_info(struct rpmsg_sdb_t *rpmsg_sdb, struct sdb_buf
 	return count;
 }
 
-static int rpmsg_sdb_mmap(struct file *file, struct vm_area_struct *vma)
+static int rpmsg_sdb_send_buf_info(struct rpmsg_sdb_t *rpmsg_sdb, struct sdb_buf_t *buffer)
 {
-	unsigned long vsize = vma->vm_end - vma->vm_start;
-	unsigned long size = PAGE_ALIGN(vsize);
-	unsigned long NumPages = size >> PAGE_SHIFT;
-	unsigned long align = get_order(size);
-	pgprot_t prot = pgprot_noncached(vma->vm_page_prot);
-	struct rpmsg_sdb_t *_rpmsg_sdb;
-	struct sdb_buf_t *_buffer;
+	int count = 0;
+	char mybuf[32];
+	struct rpmsg_sdb_desc desc;
+	bool binary;
 
-	if (align > CONFIG_CMA_ALIGNMENT)
-		align = CONFIG_CMA_ALIGNMENT;
+	spin_lock_irq(&rpmsg_sdb->lock);
+	binary = rpmsg_sdb->proto_version;
+	if (binary)
+		rpmsg_sdb_format_txbuf_desc(rpmsg_sdb, &desc, RPMSG_SDB_DESC_ANNOUNCE,
+					    buffer->index, buffer->paddr, buffer->size);
+	spin_unlock_irq(&rpmsg_sdb->lock);
 
-	if (rpmsg_sdb_dev == NULL)
-		return -ENOMEM;
+	if (binary)
+		return rpmsg_sdb_send(rpmsg_sdb, &desc, sizeof(desc));
 
-	rpmsg_sdb_dev->coherent_dma_mask = DMA_BIT_MASK(32);
-	rpmsg_sdb_dev->dma_mask = &rpmsg_sdb_dev->coherent_dma_mask;
+	count = rpmsg_sdb_format_txbuf_string(buffer, mybuf, 32);
 
-	_rpmsg_sdb = container_of(file->private_data, struct rpmsg_sdb_t,
-								mdev);
+	return rpmsg_sdb_send(rpmsg_sdb, mybuf, count);
+}
 
-	/* Field the last buffer entry which is the last one created */
-	if (!list_empty(&_rpmsg_sdb->buffer_list)) {
-		_buffer = list_last_entry(&_rpmsg_sdb->buffer_list,
-									struct sdb_buf_t, buflist);
-
-		_buffer->uaddr = NULL;
-		_buffer->size = NumPages * PAGE_SIZE;
-		_buffer->writing_size = -1;
-		_buffer->vaddr = dma_alloc_coherent(rpmsg_sdb_dev,
-							_buffer->size,
-							&_buffer->paddr,
-							GFP_KERNEL);
-
-		if (!_buffer->vaddr) {
-			pr_err("rpmsg_sdb(ERROR): Memory allocation issue\n");
-			return -ENOMEM;
-		}
+/*
+ * Direction of the cacheable buffers: the copro only writes them, but the
+ * loopback copro writes them through the CPU and cleans its lines before
+ * handing them over. Only looked at when allocating: the memory may outlive
+ * the loopback, it keeps the direction it was allocated with.
+ */
+static enum dma_data_direction rpmsg_sdb_dma_dir(struct rpmsg_sdb_t *rpmsg_sdb)
+{
+	return rpmsg_sdb->loopback ? DMA_BIDIRECTIONAL : DMA_FROM_DEVICE;
+}
 
-		pr_debug("rpmsg_sdb(%s): dma_alloc_coherent done - paddr[%d]:%x - vaddr[%d]:%p\n",
-					__func__,
-					_buffer->index,
-					_buffer->paddr,
-					_buffer->index,
-					_buffer->vaddr);
+static void rpmsg_sdb_free_buffer_mem(struct rpmsg_sdb_t *rpmsg_sdb, struct sdb_buf_t *buffer,
+				      void *vaddr)
+{
+	if (buffer->cached)
+		dma_free_noncoherent(rpmsg_sdb->dev, buffer->size, vaddr, buffer->paddr,
+				     buffer->dir);
+	else
+		dma_free_coherent(rpmsg_sdb->dev, buffer->size, vaddr, buffer->paddr);
+}
 
-		/* Get address for userland */
-		if (remap_pfn_range(vma, vma->vm_start,
-							(_buffer->paddr >> PAGE_SHIFT) + vma->vm_pgoff,
-							size, prot))
-			return -EAGAIN;
+/* Announce all the buffers of the pool, as few messages as possible */
+static int rpmsg_sdb_send_pool_info(struct rpmsg_sdb_t *rpmsg_sdb)
+{
+	struct sdb_pool_t *pool = &rpmsg_sdb->pool;
+	struct rpmsg_sdb_desc *desc;
+	int i, n, per_msg, msg_size, ret = 0;
+
+	if (!READ_ONCE(rpmsg_sdb->proto_version)) {
+		/* Legacy firmware expects one string record per message */
+		for (i = 0; i < pool->count && !ret; i++)
+			ret = rpmsg_sdb_send_buf_info(rpmsg_sdb, &pool->buffers[i]);
+		return ret;
+	}
 
-		_buffer->uaddr = (void *)vma->vm_start;
+	if (rpmsg_sdb->loopback)
+		return 0;
 
-		/* Send information to remote proc */
-		rpmsg_sdb_send_buf_info(_rpmsg_sdb, _buffer);
-	} else {
-		dev_err(rpmsg_sdb_dev, "No existing buffer entry exist in the list !!!");
-		return -EINVAL;
-	}
+	if (!rpmsg_sdb->rpdev)
+		return -ENODEV;
 
-	/* Increment for number of requested buffer */
-	LastBufferId++;
+	msg_size = rpmsg_get_mtu(rpmsg_sdb->rpdev->ept);
+	if (msg_size < 0)
+		return msg_size;
 
-	return 0;
-}
+	/* Never split a descriptor between two messages */
+	per_msg = msg_size / sizeof(*desc);
+	if (!per_msg)
+		return -EMSGSIZE;
 
-/**
- * rpmsg_sdb_open - Open Session
- *
- * @inode:	inode struct
- * @file:	file struct
- *
- * Return:
- *	0 - Success
- *	Non-zero - Failure
- */
-static int rpmsg_sdb_open(struct inode *inode, struct file *file)
-{
-	struct rpmsg_sdb_t *_rpmsg_sdb;
+	desc = kmalloc_array(pool->count, sizeof(*desc), GFP_KERNEL);
+	if (!desc)
+		return -ENOMEM;
 
-	_rpmsg_sdb = container_of(file->private_data, struct rpmsg_sdb_t,
-								mdev);
+	spin_lock_irq(&rpmsg_sdb->lock);
+	for (i = 0; i < pool->count; i++)
+		rpmsg_sdb_format_txbuf_desc(rpmsg_sdb, &desc[i], RPMSG_SDB_DESC_ANNOUNCE,
+					    pool->buffers[i].index, pool->buffers[i].paddr,
+					    pool->buffers[i].size);
+	spin_unlock_irq(&rpmsg_sdb->lock);
 
-	/* Initialize the buffer list*/
-	INIT_LIST_HEAD(&_rpmsg_sdb->buffer_list);
+	for (i = 0; i < pool->count && !ret; i += n) {
+		n = min_t(int, per_msg, pool->count - i);
+		ret = rpmsg_sdb_send(rpmsg_sdb, &desc[i], n * sizeof(*desc));
+	}
 
-	mutex_init(&_rpmsg_sdb->mutex);
+	kfree(desc);
 
-	return 0;
+	return ret;
 }
 
-/**
- * rpmsg_sdb_close - Close Session
- *
- * @inode:	inode struct
- * @file:	file struct
- *
- * Return:
- *	0 - Success
- *	Non-zero - Failure
- */
-static int rpmsg_sdb_close(struct inode *inode, struct file *file)
+/* Free the pool, called with mutex held */
+static void rpmsg_sdb_free_pool(struct rpmsg_sdb_t *rpmsg_sdb)
 {
-	struct rpmsg_sdb_t *_rpmsg_sdb;
-	struct sdb_buf_t *pos, *next;
-
-	_rpmsg_sdb = container_of(file->private_data, struct rpmsg_sdb_t,
-												mdev);
-
-	list_for_each_entry_safe(pos, next, &_rpmsg_sdb->buffer_list, buflist) {
-		/* Free the CMA allocation */
-		pr_debug("rpmsg_sdb(%s): Free the CMA allocation: pos->size:%08x, pos->vaddr:%08x, pos->paddr:%08x\n",
-					__func__,
-					pos->size,
-					pos->vaddr,
-					pos->paddr);
-
-		dma_free_coherent(rpmsg_sdb_dev, pos->size, pos->vaddr,
-					pos->paddr);
-		/* Remove the buffer from the list */
-		list_del(&pos->buflist);
-		/* Free the buffer */
-		kfree(pos);
-	}
-
-	/* Reset LastBufferId */
-	LastBufferId = 0;
-
-	return 0;
+	struct sdb_pool_t *pool = &rpmsg_sdb->pool;
+
+	if (!pool->vaddr)
+		return;
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	rpmsg_sdb->nb_buffers = 0;
+	memset(rpmsg_sdb->buffers, 0, pool->count * sizeof(rpmsg_sdb->buffers[0]));
+	spin_unlock_irq(&rpmsg_sdb->lock);
+
+	if (pool->cached)
+		dma_free_noncoherent(rpmsg_sdb->dev, pool->size, pool->vaddr, pool->paddr,
+				     pool->dir);
+	else
+		dma_free_coherent(rpmsg_sdb->dev, pool->size, pool->vaddr, pool->paddr);
+
+	kfree(pool->buffers);
+	pool->buffers = NULL;
+	pool->vaddr = NULL;
+	pool->count = 0;
 }
 
-/**
- * rpmsg_sdb_ioctl - IOCTL
- *
- * @session:	ibmvmc_file_session struct
- * @cmd:	cmd field
- * @arg:	Argument field
- *
- * Return:
- *	0 - Success
- *	Non-zero - Failure
- */
-static long rpmsg_sdb_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+/* Allocate the pool and fill the buffer table, called with mutex held */
+static int rpmsg_sdb_alloc_pool(struct rpmsg_sdb_t *rpmsg_sdb, u32 count, size_t buf_size, bool cached)
 {
-	int idx = 0;
+	struct sdb_pool_t *pool = &rpmsg_sdb->pool;
+	struct sdb_buf_t *buffers;
+	enum dma_data_direction dir = rpmsg_sdb_dma_dir(rpmsg_sdb);
+	void *vaddr;
+	dma_addr_t paddr;
+	size_t size;
+	int i;
+
+	buf_size = PAGE_ALIGN(buf_size);
+	if (!count || count > RPMSG_SDB_MAX_BUFFERS || !buf_size ||
+	    check_mul_overflow(buf_size, (size_t)count, &size))
+		return -EINVAL;
 
-	struct rpmsg_sdb_t *_rpmsg_sdb;
-	struct sdb_buf_t *buffer, *lastbuffer;
+	/* Same geometry: keep the current pool */
+	if (pool->vaddr && pool->count == count && pool->buf_size == buf_size &&
+	    pool->cached == cached)
+		return 0;
 
-	struct list_head *pos;
-	struct sdb_buf_t *datastructureptr = NULL;
+	if (pool->vaddr && atomic_read(&pool->maps)) {
+		pr_err("rpmsg_sdb(ERROR): pool still mapped, can't be reallocated\n");
+		return -EBUSY;
+	}
+	rpmsg_sdb_free_pool(rpmsg_sdb);
 
-	struct rpmsg_sdb_ioctl_set_efd q_set_efd;
-	struct rpmsg_sdb_ioctl_get_data_size q_get_dat_size;
+	buffers = kcalloc(count, sizeof(*buffers), GFP_KERNEL);
+	if (!buffers)
+		return -ENOMEM;
 
-	void __user *argp = (void __user *)arg;
+	if (cached)
+		vaddr = dma_alloc_noncoherent(rpmsg_sdb->dev, size, &paddr, dir, GFP_KERNEL);
+	else
+		vaddr = dma_alloc_coherent(rpmsg_sdb->dev, size, &paddr, GFP_KERNEL);
 
-	_rpmsg_sdb = container_of(file->private_data, struct rpmsg_sdb_t,
-								mdev);
+	if (!vaddr) {
+		pr_err("rpmsg_sdb(ERROR): Pool allocation issue (%u x %zu)\n", count, buf_size);
+		kfree(buffers);
+		return -ENOMEM;
+	}
 
-	switch (cmd) {
-	case RPMSG_SDB_IOCTL_SET_EFD:
-		mutex_lock(&_rpmsg_sdb->mutex);
+	pool->vaddr = vaddr;
+	pool->paddr = paddr;
+	pool->size = size;
+	pool->buf_size = buf_size;
+	pool->count = count;
+	pool->cached = cached;
+	pool->dir = dir;
+	pool->buffers = buffers;
+
+	for (i = 0; i < count; i++) {
+		buffers[i].index = i;
+		buffers[i].size = buf_size;
+		buffers[i].writing_size = -1;
+		buffers[i].paddr = paddr + i * buf_size;
+		buffers[i].vaddr = vaddr + i * buf_size;
+		buffers[i].cached = cached;
+		buffers[i].dir = dir;
+		buffers[i].pooled = true;
+	}
 
-		/* Get index from the last buffer in the list */
-		if (!list_empty(&_rpmsg_sdb->buffer_list)) {
-			lastbuffer = list_last_entry(&_rpmsg_sdb->buffer_list, struct sdb_buf_t, buflist);
-			idx = lastbuffer->index;
-			
-			/* Check last index was properly initiated*/
-			if (lastbuffer->vaddr == NULL) {
-				pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - previous buffer was not allocated\n");
-				mutex_unlock(&_rpmsg_sdb->mutex);
-				return -EBADE;
-			}
+	spin_lock_irq(&rpmsg_sdb->lock);
+	for (i = 0; i < count; i++)
+		rpmsg_sdb->buffers[i] = &buffers[i];
+	rpmsg_sdb->nb_buffers = count;
+	spin_unlock_irq(&rpmsg_sdb->lock);
+	rpmsg_sdb_loopback_kick(rpmsg_sdb);
 
-			/* increment this index for the next buffer creation*/
-			idx++;
-		}
+	pr_debug("rpmsg_sdb(%s): pool allocated - paddr:%pad - %u x %zu\n",
+		 __func__, &paddr, count, buf_size);
 
-		if (copy_from_user(&q_set_efd, (struct rpmsg_sdb_ioctl_set_efd *)argp,
-					sizeof(struct rpmsg_sdb_ioctl_set_efd))) {
-			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - copy from user failed\n");
-			mutex_unlock(&_rpmsg_sdb->mutex);
-			return -EFAULT;
-		}
+	return 0;
+}
 
-		/* create a new buffer which will be added in the buffer list */
-		buffer = kmalloc(sizeof(struct sdb_buf_t), GFP_KERNEL);
+static void rpmsg_sdb_pool_vma_open(struct vm_area_struct *vma)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = vma->vm_private_data;
 
-		buffer->index = idx;
-		buffer->vaddr = NULL;
-		buffer->efd_ctx = eventfd_ctx_fdget(q_set_efd.eventfd);
-		list_add_tail(&buffer->buflist, &_rpmsg_sdb->buffer_list);
+	atomic_inc(&rpmsg_sdb->pool.maps);
+}
 
-		mutex_unlock(&_rpmsg_sdb->mutex);
-		break;
+static void rpmsg_sdb_pool_vma_close(struct vm_area_struct *vma)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = vma->vm_private_data;
 
-	case RPMSG_SDB_IOCTL_GET_DATA_SIZE:
-		if (copy_from_user(&q_get_dat_size, (struct rpmsg_sdb_ioctl_get_data_size *)argp,
-					sizeof(struct rpmsg_sdb_ioctl_get_data_size))) {
-			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_GET_DATA_SIZE - copy from user failed\n");
-			return -EFAULT;
-		}
+	atomic_dec(&rpmsg_sdb->pool.maps);
+}
 
-		/* Get the index of the requested buffer and then look-up in the buffer list*/
-		idx = q_get_dat_size.bufferId;
+static const struct vm_operations_struct rpmsg_sdb_pool_vm_ops = {
+	.open = rpmsg_sdb_pool_vma_open,
+	.close = rpmsg_sdb_pool_vma_close,
+};
 
-		list_for_each(pos, &_rpmsg_sdb->buffer_list)
-		{
-			datastructureptr = list_entry(pos, struct sdb_buf_t, buflist);
-			if (datastructureptr->index == idx) {
-				/* Get the writing size*/
-				q_get_dat_size.size = datastructureptr->writing_size;
-				break;
-			}
-		}
+static int rpmsg_sdb_mmap_pool(struct sdb_session_t *session, struct vm_area_struct *vma)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	struct sdb_pool_t *pool = &rpmsg_sdb->pool;
+	unsigned long vsize = vma->vm_end - vma->vm_start;
+	pgprot_t prot;
 
-		if (copy_to_user((struct rpmsg_sdb_ioctl_get_data_size *)argp, &q_get_dat_size,
-					 sizeof(struct rpmsg_sdb_ioctl_get_data_size))) {
-			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_GET_DATA_SIZE - copy to user failed\n");
-			return -EFAULT;
-		}
+	mutex_lock(&rpmsg_sdb->mutex);
 
-		/* Reset the writing size*/
-		datastructureptr->writing_size = -1;
+	if (rpmsg_sdb->owner != session && !session->reader) {
+		mutex_unlock(&rpmsg_sdb->mutex);
+		return -EBUSY;
+	}
 
-		break;
-	default:
+	/* Readers must not scribble on the data seen by the other sessions */
+	if (session->reader) {
+		if (vma->vm_flags & VM_WRITE) {
+			mutex_unlock(&rpmsg_sdb->mutex);
+			return -EPERM;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	if (!pool->vaddr || vsize > pool->size) {
+		dev_err(rpmsg_sdb->dev, "No pool to map or mapping too large !!!");
+		mutex_unlock(&rpmsg_sdb->mutex);
 		return -EINVAL;
 	}
 
+	prot = pool->cached ? vma->vm_page_prot : pgprot_noncached(vma->vm_page_prot);
+	if (remap_pfn_range(vma, vma->vm_start, pool->paddr >> PAGE_SHIFT, vsize, prot)) {
+		mutex_unlock(&rpmsg_sdb->mutex);
+		return -EAGAIN;
+	}
+
+	vma->vm_ops = &rpmsg_sdb_pool_vm_ops;
+	vma->vm_private_data = rpmsg_sdb;
+	rpmsg_sdb_pool_vma_open(vma);
+
+	mutex_unlock(&rpmsg_sdb->mutex);
+
 	return 0;
 }
 
-static const struct file_operations rpmsg_sdb_fops = {
-	.owner			= THIS_MODULE,
-	.unlocked_ioctl	= rpmsg_sdb_ioctl,
-	.mmap			= rpmsg_sdb_mmap,
-	.open           = rpmsg_sdb_open,
-	.release        = rpmsg_sdb_close,
-};
-
-static int rpmsg_sdb_drv_cb(struct rpmsg_device *rpdev, void *data, int len,
-			void *priv, u32 src)
+static int rpmsg_sdb_mmap_ring(struct sdb_session_t *session, struct vm_area_struct *vma)
 {
-	int ret = 0;
-	int buffer_id = 0;
-	size_t buffer_size;
-	char *rpmsg_RxBuf;
-	struct list_head *pos;
-	struct sdb_buf_t *datastructureptr = NULL;
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	int ret;
 
-	struct rpmsg_sdb_t *drv = dev_get_drvdata(&rpdev->dev);
+	mutex_lock(&rpmsg_sdb->mutex);
 
-	if (len == 0) {
-		dev_err(rpmsg_sdb_dev, "(%s) Empty lenght requested\n", __func__);
+	if (!session->ring) {
+		dev_err(rpmsg_sdb->dev, "No completion ring set up !!!");
+		mutex_unlock(&rpmsg_sdb->mutex);
 		return -EINVAL;
 	}
 
-    //dev_err(rpmsg_sdb_dev, "(%s) lenght: %d\n", __func__,len);
-
-    rpmsg_RxBuf = (char *)kmalloc(len+1, GFP_KERNEL);
-	memcpy(rpmsg_RxBuf, data, len);
-
-    rpmsg_RxBuf[len] = 0;
-
-	ret = rpmsg_sdb_decode_rxbuf_string(rpmsg_RxBuf, &buffer_id, &buffer_size);
-    kfree(rpmsg_RxBuf);
-	if (ret < 0)
-		goto out;
-
-	if (buffer_id > LastBufferId) {
-		ret = -EINVAL;
-		goto out;
+	if (vma->vm_end - vma->vm_start > session->ring_size) {
+		mutex_unlock(&rpmsg_sdb->mutex);
+		return -EINVAL;
 	}
 
-	/* Signal to User space application */
-	list_for_each(pos, &drv->buffer_list)
-	{
-		datastructureptr = list_entry(pos, struct sdb_buf_t, buflist);
-		if (datastructureptr->index == buffer_id) {
-			datastructureptr->writing_size = buffer_size;
-
-			if (datastructureptr->writing_size > datastructureptr->size) {
-				dev_err(rpmsg_sdb_dev, "(%s) Writing size is bigger than buffer size\n", __func__);
-				ret = -EINVAL;
-				goto out;
-			}
+	ret = remap_vmalloc_range(vma, session->ring, 0);
 
-			eventfd_signal(datastructureptr->efd_ctx, 1);
-			break;
-		}
-		/* TODO: quid if nothing find during the loop ? */
-	}
+	mutex_unlock(&rpmsg_sdb->mutex);
 
-out:
 	return ret;
 }
 
-static int rpmsg_sdb_drv_probe(struct rpmsg_device *rpdev)
+static int rpmsg_sdb_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long vsize = vma->vm_end - vma->vm_start;
+	unsigned long size = PAGE_ALIGN(vsize);
+	unsigned long NumPages = size >> PAGE_SHIFT;
+	unsigned long align = get_order(size);
+	pgprot_t prot = pgprot_noncached(vma->vm_page_prot);
+	struct sdb_session_t *session = file->private_data;
+	struct rpmsg_sdb_t *_rpmsg_sdb = session->drv;
+	struct sdb_buf_t *_buffer;
+	void *vaddr;
+
+	if (align > CONFIG_CMA_ALIGNMENT)
+		align = CONFIG_CMA_ALIGNMENT;
+
+	if (vma->vm_pgoff == RPMSG_SDB_RING_MMAP_OFFSET >> PAGE_SHIFT)
+		return rpmsg_sdb_mmap_ring(session, vma);
+
+	if (vma->vm_pgoff == RPMSG_SDB_POOL_MMAP_OFFSET >> PAGE_SHIFT)
+		return rpmsg_sdb_mmap_pool(session, vma);
+
+	mutex_lock(&_rpmsg_sdb->mutex);
+
+	/* Field the last buffer entry which is the last one created */
+	if (_rpmsg_sdb->owner != session || !_rpmsg_sdb->nb_buffers || _rpmsg_sdb->pool.vaddr ||
+	    _rpmsg_sdb->buffers[_rpmsg_sdb->nb_buffers - 1]->vaddr) {
+		dev_err(_rpmsg_sdb->dev, "No buffer entry waiting for allocation !!!");
+		mutex_unlock(&_rpmsg_sdb->mutex);
+		return -EINVAL;
+	}
+
+	_buffer = _rpmsg_sdb->buffers[_rpmsg_sdb->nb_buffers - 1];
+	_buffer->uaddr = NULL;
+	_buffer->size = NumPages * PAGE_SIZE;
+	_buffer->writing_size = -1;
+	_buffer->cached = session->map_cached;
+	_buffer->dir = rpmsg_sdb_dma_dir(_rpmsg_sdb);
+	if (_buffer->cached) {
+		/* Cacheable in the kernel too, to avoid mismatched aliases */
+		vaddr = dma_alloc_noncoherent(_rpmsg_sdb->dev, _buffer->size, &_buffer->paddr,
+					      _buffer->dir, GFP_KERNEL);
+		prot = vma->vm_page_prot;
+	} else {
+		vaddr = dma_alloc_coherent(_rpmsg_sdb->dev, _buffer->size, &_buffer->paddr,
+					   GFP_KERNEL);
+	}
+
+	if (!vaddr) {
+		pr_err("rpmsg_sdb(ERROR): Memory allocation issue\n");
+		mutex_unlock(&_rpmsg_sdb->mutex);
+		return -ENOMEM;
+	}
+
+	pr_debug("rpmsg_sdb(%s): dma_alloc_coherent done - paddr[%d]:%x - vaddr[%d]:%p\n",
+				__func__,
+				_buffer->index,
+				_buffer->paddr,
+				_buffer->index,
+				vaddr);
+
+	/* Get address for userland */
+	if (remap_pfn_range(vma, vma->vm_start,
+						(_buffer->paddr >> PAGE_SHIFT) + vma->vm_pgoff,
+						size, prot)) {
+		rpmsg_sdb_free_buffer_mem(_rpmsg_sdb, _buffer, vaddr);
+		mutex_unlock(&_rpmsg_sdb->mutex);
+		return -EAGAIN;
+	}
+
+	_buffer->uaddr = (void *)vma->vm_start;
+
+	/* The buffer is now visible from the rpmsg callback */
+	spin_lock_irq(&_rpmsg_sdb->lock);
+	_buffer->vaddr = vaddr;
+	spin_unlock_irq(&_rpmsg_sdb->lock);
+
+	/* Send information to remote proc */
+	rpmsg_sdb_send_buf_info(_rpmsg_sdb, _buffer);
+
+	mutex_unlock(&_rpmsg_sdb->mutex);
+
+	return 0;
+}
+
+/**
+ * rpmsg_sdb_open - Open Session
+ *
+ * @inode:	inode struct
+ * @file:	file struct
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int rpmsg_sdb_open(struct inode *inode, struct file *file)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = container_of(file->private_data, struct rpmsg_sdb_t,
+						     mdev);
+	struct sdb_session_t *session;
+
+	/* The buffer table, mutex and lock are initialized at probe */
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	session->drv = rpmsg_sdb;
+	INIT_LIST_HEAD(&session->node);
+	init_waitqueue_head(&session->wait);
+	kref_get(&rpmsg_sdb->kref);
+	file->private_data = session;
+
+	return 0;
+}
+
+static void rpmsg_sdb_free(struct kref *kref)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = container_of(kref, struct rpmsg_sdb_t, kref);
+
+	mutex_lock(&rpmsg_sdb->mutex);
+	rpmsg_sdb_free_pool(rpmsg_sdb);
+	mutex_unlock(&rpmsg_sdb->mutex);
+
+	put_device(rpmsg_sdb->dev);
+	ida_free(&rpmsg_sdb_ida, rpmsg_sdb->id);
+	kfree(rpmsg_sdb);
+}
+
+/*
+ * The first session to set up buffers owns the device until it is closed,
+ * the others can't interfere with its buffers. Called with mutex held.
+ */
+static int rpmsg_sdb_claim(struct sdb_session_t *session)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+
+	if (rpmsg_sdb->owner == session)
+		return 0;
+
+	if (rpmsg_sdb->owner || session->reader || (!rpmsg_sdb->rpdev && !rpmsg_sdb->loopback))
+		return -EBUSY;
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	rpmsg_sdb->owner = session;
+	spin_unlock_irq(&rpmsg_sdb->lock);
+
+	return 0;
+}
+
+/* Exported dma-buf, a range of the pool */
+struct sdb_dmabuf_t {
+	struct rpmsg_sdb_t *drv; /* holds a reference on the device */
+	dma_addr_t paddr; /* physical address */
+	size_t size; /* exported size */
+	bool cached; /* cacheable mapping */
+	enum dma_data_direction dir; /* of the cacheable mapping */
+};
+
+static struct sg_table *rpmsg_sdb_dmabuf_map(struct dma_buf_attachment *attach,
+					     enum dma_data_direction dir)
+{
+	struct sdb_dmabuf_t *sdb_dmabuf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	/* CMA memory is physically contiguous, one entry is enough */
+	ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (ret)
+		goto err_free;
+
+	sg_set_page(sgt->sgl, pfn_to_page(sdb_dmabuf->paddr >> PAGE_SHIFT),
+		    sdb_dmabuf->size, 0);
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto err_free_table;
+
+	return sgt;
+
+err_free_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void rpmsg_sdb_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				   enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int rpmsg_sdb_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct sdb_dmabuf_t *sdb_dmabuf = dmabuf->priv;
+	unsigned long vsize = vma->vm_end - vma->vm_start;
+	pgprot_t prot;
+
+	if (vma->vm_pgoff >= sdb_dmabuf->size >> PAGE_SHIFT ||
+	    vsize > sdb_dmabuf->size - (vma->vm_pgoff << PAGE_SHIFT))
+		return -EINVAL;
+
+	prot = sdb_dmabuf->cached ? vma->vm_page_prot : pgprot_noncached(vma->vm_page_prot);
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       (sdb_dmabuf->paddr >> PAGE_SHIFT) + vma->vm_pgoff, vsize, prot);
+}
+
+static int rpmsg_sdb_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					     enum dma_data_direction dir)
+{
+	struct sdb_dmabuf_t *sdb_dmabuf = dmabuf->priv;
+
+	if (sdb_dmabuf->cached)
+		dma_sync_single_for_cpu(sdb_dmabuf->drv->dev, sdb_dmabuf->paddr,
+					sdb_dmabuf->size, sdb_dmabuf->dir);
+	return 0;
+}
+
+static int rpmsg_sdb_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+					   enum dma_data_direction dir)
+{
+	struct sdb_dmabuf_t *sdb_dmabuf = dmabuf->priv;
+
+	if (sdb_dmabuf->cached)
+		dma_sync_single_for_device(sdb_dmabuf->drv->dev, sdb_dmabuf->paddr,
+					   sdb_dmabuf->size, sdb_dmabuf->dir);
+	return 0;
+}
+
+static void rpmsg_sdb_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct sdb_dmabuf_t *sdb_dmabuf = dmabuf->priv;
+	struct rpmsg_sdb_t *rpmsg_sdb = sdb_dmabuf->drv;
+
+	atomic_dec(&rpmsg_sdb->pool.maps);
+	kfree(sdb_dmabuf);
+	kref_put(&rpmsg_sdb->kref, rpmsg_sdb_free);
+}
+
+static const struct dma_buf_ops rpmsg_sdb_dmabuf_ops = {
+	.map_dma_buf = rpmsg_sdb_dmabuf_map,
+	.unmap_dma_buf = rpmsg_sdb_dmabuf_unmap,
+	.mmap = rpmsg_sdb_dmabuf_mmap,
+	.begin_cpu_access = rpmsg_sdb_dmabuf_begin_cpu_access,
+	.end_cpu_access = rpmsg_sdb_dmabuf_end_cpu_access,
+	.release = rpmsg_sdb_dmabuf_release,
+};
+
+/* Export a pool buffer or the whole pool, returns the fd. Called with mutex held */
+static int rpmsg_sdb_export_dmabuf(struct sdb_session_t *session, int buffer_id)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	struct sdb_pool_t *pool = &rpmsg_sdb->pool;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct sdb_dmabuf_t *sdb_dmabuf;
+	struct dma_buf *dmabuf;
+	int fd;
+
+	if (rpmsg_sdb->owner != session && !session->reader)
+		return -EBUSY;
+
+	if (!pool->vaddr || buffer_id < -1 || buffer_id >= (int)pool->count)
+		return -EINVAL;
+
+	sdb_dmabuf = kzalloc(sizeof(*sdb_dmabuf), GFP_KERNEL);
+	if (!sdb_dmabuf)
+		return -ENOMEM;
+
+	sdb_dmabuf->drv = rpmsg_sdb;
+	sdb_dmabuf->cached = pool->cached;
+	sdb_dmabuf->dir = pool->dir;
+	if (buffer_id < 0) {
+		sdb_dmabuf->paddr = pool->paddr;
+		sdb_dmabuf->size = pool->size;
+	} else {
+		sdb_dmabuf->paddr = pool->buffers[buffer_id].paddr;
+		sdb_dmabuf->size = pool->buffers[buffer_id].size;
+	}
+
+	exp_info.ops = &rpmsg_sdb_dmabuf_ops;
+	exp_info.size = sdb_dmabuf->size;
+	exp_info.flags = session->reader ? O_RDONLY : O_RDWR;
+	exp_info.priv = sdb_dmabuf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		kfree(sdb_dmabuf);
+		return PTR_ERR(dmabuf);
+	}
+
+	/* From now on, the dma-buf release undoes these */
+	kref_get(&rpmsg_sdb->kref);
+	atomic_inc(&pool->maps);
+
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0)
+		dma_buf_put(dmabuf);
+
+	return fd;
+}
+
+static void rpmsg_sdb_stats_reset(struct sdb_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->lat_min = U64_MAX;
+	stats->since = ktime_get();
+}
+
+/* Account the time a buffer was owned by userland, called with lock held */
+static void rpmsg_sdb_stats_latency(struct sdb_stats_t *stats, ktime_t latency)
+{
+	u64 ns = ktime_to_ns(latency);
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = us ? ilog2(us) : 0;
+
+	stats->lat_count++;
+	stats->lat_sum += ns;
+	stats->lat_min = min(stats->lat_min, ns);
+	stats->lat_max = max(stats->lat_max, ns);
+	stats->lat_hist[min(bucket, RPMSG_SDB_LAT_BUCKETS - 1)]++;
+}
+
+/*
+ * Drop a hold on the completion of a buffer, tracked in the held bitmap of a
+ * session or by a splice reference (held is NULL). The buffer goes back to
+ * the copro with the last hold. Called with mutex held.
+ */
+static int rpmsg_sdb_drop_hold(struct rpmsg_sdb_t *rpmsg_sdb, int buffer_id, unsigned long *held)
+{
+	struct sdb_buf_t *buffer;
+	struct rpmsg_sdb_desc desc;
+	bool binary;
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	buffer = rpmsg_sdb_get_buffer(rpmsg_sdb, buffer_id);
+	if (!buffer || (held && !__test_and_clear_bit(buffer_id, held)) || !buffer->holders) {
+		spin_unlock_irq(&rpmsg_sdb->lock);
+		return -EINVAL;
+	}
+	if (--buffer->holders) {
+		spin_unlock_irq(&rpmsg_sdb->lock);
+		return 0;
+	}
+	buffer->state = SDB_BUF_COPRO;
+	rpmsg_sdb_stats_latency(&rpmsg_sdb->stats, ktime_sub(ktime_get(), buffer->done_time));
+
+	/* Return the credit */
+	binary = rpmsg_sdb->proto_version;
+	if (binary) {
+		rpmsg_sdb_format_txbuf_desc(rpmsg_sdb, &desc, RPMSG_SDB_DESC_RELEASE,
+					    buffer_id, 0, 0);
+		if (buffer->overrun)
+			desc.flags = cpu_to_le32(RPMSG_SDB_DESC_F_OVERRUN);
+	}
+	buffer->overrun = false;
+	spin_unlock_irq(&rpmsg_sdb->lock);
+	rpmsg_sdb_loopback_kick(rpmsg_sdb);
+
+	if (!binary)
+		return 0;
+
+	return rpmsg_sdb_send(rpmsg_sdb, &desc, sizeof(desc));
+}
+
+static int rpmsg_sdb_release_buffer(struct sdb_session_t *session, int buffer_id)
+{
+	return rpmsg_sdb_drop_hold(session->drv, buffer_id, session->held);
+}
+
+static void rpmsg_sdb_splice_ref_put(struct sdb_splice_ref_t *ref);
+
+/**
+ * rpmsg_sdb_close - Close Session
+ *
+ * @inode:	inode struct
+ * @file:	file struct
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int rpmsg_sdb_close(struct inode *inode, struct file *file)
+{
+	struct sdb_session_t *session = file->private_data;
+	struct rpmsg_sdb_t *_rpmsg_sdb = session->drv;
+	struct sdb_buf_t *pos;
+	int i, nb_buffers = 0;
+
+	mutex_lock(&_rpmsg_sdb->mutex);
+
+	/* Hide the buffers and the ring from the rpmsg callback before freeing them */
+	spin_lock_irq(&_rpmsg_sdb->lock);
+	if (session->reader) {
+		list_del(&session->node);
+	} else if (_rpmsg_sdb->owner != session) {
+		/* Nothing of this session is visible from the callback */
+	} else if (_rpmsg_sdb->pool.vaddr) {
+		/* The pool is kept for the next session */
+		for (i = 0; i < _rpmsg_sdb->nb_buffers; i++)
+			_rpmsg_sdb->buffers[i]->writing_size = -1;
+	} else {
+		nb_buffers = _rpmsg_sdb->nb_buffers;
+		_rpmsg_sdb->nb_buffers = 0;
+	}
+	if (_rpmsg_sdb->owner == session)
+		_rpmsg_sdb->owner = NULL;
+	spin_unlock_irq(&_rpmsg_sdb->lock);
+
+	/* Completions the session didn't release, the pool buffers go back to the copro */
+	for_each_set_bit(i, session->held, RPMSG_SDB_MAX_BUFFERS)
+		rpmsg_sdb_release_buffer(session, i);
+
+	for (i = 0; i < nb_buffers; i++) {
+		pos = _rpmsg_sdb->buffers[i];
+		_rpmsg_sdb->buffers[i] = NULL;
+
+		if (pos->vaddr) {
+			/* Free the CMA allocation */
+			pr_debug("rpmsg_sdb(%s): Free the CMA allocation: pos->size:%08x, pos->vaddr:%08x, pos->paddr:%08x\n",
+						__func__,
+						pos->size,
+						pos->vaddr,
+						pos->paddr);
+
+			rpmsg_sdb_free_buffer_mem(_rpmsg_sdb, pos, pos->vaddr);
+		}
+		if (pos->efd_ctx)
+			eventfd_ctx_put(pos->efd_ctx);
+		/* Free the buffer */
+		kfree(pos);
+	}
+
+	mutex_unlock(&_rpmsg_sdb->mutex);
+
+	/* The pipe may still hold the pages of a partly spliced completion */
+	if (session->splice_ref)
+		rpmsg_sdb_splice_ref_put(session->splice_ref);
+
+	/* Release the completion ring */
+	vfree(session->ring);
+	if (session->ring_efd_ctx)
+		eventfd_ctx_put(session->ring_efd_ctx);
+	kfree(session);
+
+	kref_put(&_rpmsg_sdb->kref, rpmsg_sdb_free);
+
+	return 0;
+}
+
+static int rpmsg_sdb_setup_ring(struct sdb_session_t *session, u32 entries, int eventfd)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	struct rpmsg_sdb_ring *ring;
+	struct eventfd_ctx *efd_ctx;
+	size_t ring_size;
+
+	ring_size = PAGE_ALIGN(struct_size(ring, entry, entries));
+
+	efd_ctx = eventfd_ctx_fdget(eventfd);
+	if (IS_ERR(efd_ctx)) {
+		pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SETUP_RING - invalid eventfd\n");
+		return PTR_ERR(efd_ctx);
+	}
+
+	/* Zeroed and page aligned, as needed to be mapped in userland */
+	ring = vmalloc_user(ring_size);
+	if (!ring) {
+		eventfd_ctx_put(efd_ctx);
+		return -ENOMEM;
+	}
+	ring->entries = entries;
+
+	mutex_lock(&rpmsg_sdb->mutex);
+
+	if (session->ring) {
+		mutex_unlock(&rpmsg_sdb->mutex);
+		vfree(ring);
+		eventfd_ctx_put(efd_ctx);
+		return -EBUSY;
+	}
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	session->ring = ring;
+	session->ring_size = ring_size;
+	session->ring_entries = entries;
+	session->ring_prod = 0;
+	session->ring_efd_ctx = efd_ctx;
+	spin_unlock_irq(&rpmsg_sdb->lock);
+
+	mutex_unlock(&rpmsg_sdb->mutex);
+
+	return 0;
+}
+
+/**
+ * rpmsg_sdb_ioctl - IOCTL
+ *
+ * @session:	ibmvmc_file_session struct
+ * @cmd:	cmd field
+ * @arg:	Argument field
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long rpmsg_sdb_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int idx = 0;
+
+	struct sdb_session_t *session;
+	struct rpmsg_sdb_t *_rpmsg_sdb;
+	struct sdb_buf_t *buffer;
+	struct eventfd_ctx *efd_ctx;
+
+	struct rpmsg_sdb_ioctl_set_efd q_set_efd;
+	struct rpmsg_sdb_ioctl_get_data_size q_get_dat_size;
+	struct rpmsg_sdb_ioctl_setup_ring q_setup_ring;
+	struct rpmsg_sdb_ioctl_set_map_mode q_set_map_mode;
+	struct rpmsg_sdb_ioctl_cpu_access q_cpu_access;
+	struct rpmsg_sdb_ioctl_alloc_pool q_alloc_pool;
+	struct rpmsg_sdb_ioctl_release_buffer q_release_buffer;
+	struct rpmsg_sdb_ioctl_attach q_attach;
+	struct rpmsg_sdb_ioctl_export_dmabuf q_export_dmabuf;
+	struct sdb_session_t *reader;
+	size_t data_size;
+	int ret;
+
+	void __user *argp = (void __user *)arg;
+
+	session = file->private_data;
+	_rpmsg_sdb = session->drv;
+
+	switch (cmd) {
+	case RPMSG_SDB_IOCTL_SET_EFD:
+		if (copy_from_user(&q_set_efd, (struct rpmsg_sdb_ioctl_set_efd *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_set_efd))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		mutex_lock(&_rpmsg_sdb->mutex);
+
+		if (rpmsg_sdb_claim(session)) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - device used by another session\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EBUSY;
+		}
+
+		if (_rpmsg_sdb->pool.vaddr) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - buffers come from the pool\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EBUSY;
+		}
+
+		/* The new buffer takes the next free index of the table */
+		idx = _rpmsg_sdb->nb_buffers;
+
+		/* Check last index was properly initiated*/
+		if (idx && !_rpmsg_sdb->buffers[idx - 1]->vaddr) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - previous buffer was not allocated\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EBADE;
+		}
+
+		if (idx >= RPMSG_SDB_MAX_BUFFERS) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - too many buffers\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -ENOSPC;
+		}
+
+		/* No eventfd when the completions are only read from the ring */
+		efd_ctx = NULL;
+		if (q_set_efd.eventfd >= 0) {
+			efd_ctx = eventfd_ctx_fdget(q_set_efd.eventfd);
+			if (IS_ERR(efd_ctx)) {
+				pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_EFD - invalid eventfd\n");
+				mutex_unlock(&_rpmsg_sdb->mutex);
+				return PTR_ERR(efd_ctx);
+			}
+		}
+
+		/* create a new buffer which will be added in the buffer table */
+		buffer = kzalloc(sizeof(struct sdb_buf_t), GFP_KERNEL);
+		if (!buffer) {
+			if (efd_ctx)
+				eventfd_ctx_put(efd_ctx);
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -ENOMEM;
+		}
+
+		buffer->index = idx;
+		buffer->efd_ctx = efd_ctx;
+
+		spin_lock_irq(&_rpmsg_sdb->lock);
+		_rpmsg_sdb->buffers[idx] = buffer;
+		_rpmsg_sdb->nb_buffers++;
+		spin_unlock_irq(&_rpmsg_sdb->lock);
+
+		mutex_unlock(&_rpmsg_sdb->mutex);
+		break;
+
+	case RPMSG_SDB_IOCTL_GET_DATA_SIZE:
+		if (copy_from_user(&q_get_dat_size, (struct rpmsg_sdb_ioctl_get_data_size *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_get_data_size))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_GET_DATA_SIZE - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		/* Get the writing size of the requested buffer and reset it */
+		spin_lock_irq(&_rpmsg_sdb->lock);
+		buffer = rpmsg_sdb_get_buffer(_rpmsg_sdb, q_get_dat_size.bufferId);
+		if (!buffer || _rpmsg_sdb->owner != session) {
+			spin_unlock_irq(&_rpmsg_sdb->lock);
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_GET_DATA_SIZE - unknown buffer %d\n",
+			       q_get_dat_size.bufferId);
+			return -EINVAL;
+		}
+		q_get_dat_size.size = buffer->writing_size;
+		buffer->writing_size = -1;
+		spin_unlock_irq(&_rpmsg_sdb->lock);
+
+		/* Legacy users don't release their buffers, reading the size does */
+		mutex_lock(&_rpmsg_sdb->mutex);
+		rpmsg_sdb_release_buffer(session, q_get_dat_size.bufferId);
+		mutex_unlock(&_rpmsg_sdb->mutex);
+
+		if (copy_to_user((struct rpmsg_sdb_ioctl_get_data_size *)argp, &q_get_dat_size,
+					 sizeof(struct rpmsg_sdb_ioctl_get_data_size))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_GET_DATA_SIZE - copy to user failed\n");
+			return -EFAULT;
+		}
+
+		break;
+
+	case RPMSG_SDB_IOCTL_SETUP_RING:
+		if (copy_from_user(&q_setup_ring, (struct rpmsg_sdb_ioctl_setup_ring *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_setup_ring))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SETUP_RING - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		if (!is_power_of_2(q_setup_ring.entries) ||
+		    q_setup_ring.entries > RPMSG_SDB_RING_MAX_ENTRIES) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SETUP_RING - invalid number of entries\n");
+			return -EINVAL;
+		}
+
+		return rpmsg_sdb_setup_ring(session, q_setup_ring.entries,
+					    q_setup_ring.eventfd);
+
+	case RPMSG_SDB_IOCTL_ALLOC_POOL:
+		if (copy_from_user(&q_alloc_pool, (struct rpmsg_sdb_ioctl_alloc_pool *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_alloc_pool))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ALLOC_POOL - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		mutex_lock(&_rpmsg_sdb->mutex);
+
+		if (rpmsg_sdb_claim(session)) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ALLOC_POOL - device used by another session\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EBUSY;
+		}
+
+		if (_rpmsg_sdb->nb_buffers && !_rpmsg_sdb->pool.vaddr) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ALLOC_POOL - buffers already allocated\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EBUSY;
+		}
+
+		ret = rpmsg_sdb_alloc_pool(_rpmsg_sdb, q_alloc_pool.count, q_alloc_pool.size,
+					   q_alloc_pool.flags & RPMSG_SDB_POOL_CACHED);
+		if (!ret) {
+			/* (Re)announce all the buffers in one batch, the copro owns them */
+			spin_lock_irq(&_rpmsg_sdb->lock);
+			for (idx = 0; idx < _rpmsg_sdb->nb_buffers; idx++) {
+				_rpmsg_sdb->buffers[idx]->state = SDB_BUF_COPRO;
+				_rpmsg_sdb->buffers[idx]->holders = 0;
+			}
+			bitmap_zero(session->held, RPMSG_SDB_MAX_BUFFERS);
+			list_for_each_entry(reader, &_rpmsg_sdb->readers, node)
+				bitmap_zero(reader->held, RPMSG_SDB_MAX_BUFFERS);
+			spin_unlock_irq(&_rpmsg_sdb->lock);
+			rpmsg_sdb_loopback_kick(_rpmsg_sdb);
+			ret = rpmsg_sdb_send_pool_info(_rpmsg_sdb);
+			q_alloc_pool.size = _rpmsg_sdb->pool.buf_size;
+		}
+
+		mutex_unlock(&_rpmsg_sdb->mutex);
+
+		if (ret)
+			return ret;
+
+		if (copy_to_user((struct rpmsg_sdb_ioctl_alloc_pool *)argp, &q_alloc_pool,
+					 sizeof(struct rpmsg_sdb_ioctl_alloc_pool))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ALLOC_POOL - copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+
+	case RPMSG_SDB_IOCTL_RELEASE_BUFFER:
+		if (copy_from_user(&q_release_buffer, (struct rpmsg_sdb_ioctl_release_buffer *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_release_buffer))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_RELEASE_BUFFER - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		mutex_lock(&_rpmsg_sdb->mutex);
+		ret = rpmsg_sdb_release_buffer(session, q_release_buffer.bufferId);
+		mutex_unlock(&_rpmsg_sdb->mutex);
+
+		if (ret == -EINVAL)
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_RELEASE_BUFFER - buffer %d not owned\n",
+			       q_release_buffer.bufferId);
+		return ret;
+
+	case RPMSG_SDB_IOCTL_ATTACH:
+		mutex_lock(&_rpmsg_sdb->mutex);
+
+		if (_rpmsg_sdb->owner == session || session->reader || !_rpmsg_sdb->pool.vaddr) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ATTACH - no pool to attach to\n");
+			mutex_unlock(&_rpmsg_sdb->mutex);
+			return -EINVAL;
+		}
+
+		q_attach.count = _rpmsg_sdb->pool.count;
+		q_attach.size = _rpmsg_sdb->pool.buf_size;
+		q_attach.flags = _rpmsg_sdb->pool.cached ? RPMSG_SDB_POOL_CACHED : 0;
+
+		spin_lock_irq(&_rpmsg_sdb->lock);
+		session->reader = true;
+		list_add_tail(&session->node, &_rpmsg_sdb->readers);
+		spin_unlock_irq(&_rpmsg_sdb->lock);
+
+		mutex_unlock(&_rpmsg_sdb->mutex);
+
+		if (copy_to_user((struct rpmsg_sdb_ioctl_attach *)argp, &q_attach,
+					 sizeof(struct rpmsg_sdb_ioctl_attach))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_ATTACH - copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+
+	case RPMSG_SDB_IOCTL_EXPORT_DMABUF:
+		if (copy_from_user(&q_export_dmabuf, (struct rpmsg_sdb_ioctl_export_dmabuf *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_export_dmabuf))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_EXPORT_DMABUF - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		mutex_lock(&_rpmsg_sdb->mutex);
+		ret = rpmsg_sdb_export_dmabuf(session, q_export_dmabuf.bufferId);
+		mutex_unlock(&_rpmsg_sdb->mutex);
+
+		if (ret < 0) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_EXPORT_DMABUF - export of buffer %d failed\n",
+			       q_export_dmabuf.bufferId);
+			return ret;
+		}
+
+		/* The fd is already installed, closing it on error is up to userland */
+		q_export_dmabuf.fd = ret;
+		if (copy_to_user((struct rpmsg_sdb_ioctl_export_dmabuf *)argp, &q_export_dmabuf,
+					 sizeof(struct rpmsg_sdb_ioctl_export_dmabuf))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_EXPORT_DMABUF - copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+
+	case RPMSG_SDB_IOCTL_SET_MAP_MODE:
+		if (copy_from_user(&q_set_map_mode, (struct rpmsg_sdb_ioctl_set_map_mode *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_set_map_mode))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_SET_MAP_MODE - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		mutex_lock(&_rpmsg_sdb->mutex);
+		session->map_cached = !!q_set_map_mode.cached;
+		mutex_unlock(&_rpmsg_sdb->mutex);
+		break;
+
+	case RPMSG_SDB_IOCTL_BEGIN_CPU_ACCESS:
+	case RPMSG_SDB_IOCTL_END_CPU_ACCESS:
+		if (copy_from_user(&q_cpu_access, (struct rpmsg_sdb_ioctl_cpu_access *)argp,
+					sizeof(struct rpmsg_sdb_ioctl_cpu_access))) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_CPU_ACCESS - copy from user failed\n");
+			return -EFAULT;
+		}
+
+		spin_lock_irq(&_rpmsg_sdb->lock);
+		buffer = rpmsg_sdb_get_buffer(_rpmsg_sdb, q_cpu_access.bufferId);
+		if (_rpmsg_sdb->owner != session && !session->reader)
+			buffer = NULL;
+		data_size = buffer ? buffer->data_size : 0;
+		spin_unlock_irq(&_rpmsg_sdb->lock);
+
+		if (!buffer) {
+			pr_err("rpmsg_sdb(ERROR): RPMSG_SDB_IOCTL_CPU_ACCESS - unknown buffer %d\n",
+			       q_cpu_access.bufferId);
+			return -EINVAL;
+		}
+
+		/* Only the range written by the copro needs to be synced */
+		if (!buffer->cached || !data_size)
+			break;
+
+		if (cmd == RPMSG_SDB_IOCTL_BEGIN_CPU_ACCESS)
+			dma_sync_single_for_cpu(_rpmsg_sdb->dev, buffer->paddr, data_size,
+						buffer->dir);
+		else
+			dma_sync_single_for_device(_rpmsg_sdb->dev, buffer->paddr, data_size,
+						   buffer->dir);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Hold on a completion shared by the pipe buffers of its pages */
+struct sdb_splice_ref_t {
+	struct rpmsg_sdb_t *drv; /* holds a reference on the device */
+	int buffer_id; /* spliced buffer */
+	refcount_t refs; /* pipe buffers, plus the session while splicing */
+};
+
+static void rpmsg_sdb_splice_ref_put(struct sdb_splice_ref_t *ref)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = ref->drv;
+
+	if (!refcount_dec_and_test(&ref->refs))
+		return;
+
+	/* Called from the pipe code, never with our mutex held */
+	mutex_lock(&rpmsg_sdb->mutex);
+	rpmsg_sdb_drop_hold(rpmsg_sdb, ref->buffer_id, NULL);
+	mutex_unlock(&rpmsg_sdb->mutex);
+
+	atomic_dec(&rpmsg_sdb->pool.maps);
+	kfree(ref);
+	kref_put(&rpmsg_sdb->kref, rpmsg_sdb_free);
+	/* Taken with the reference, the pipe may have outlived the file */
+	module_put(THIS_MODULE);
+}
+
+static void rpmsg_sdb_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+	rpmsg_sdb_splice_ref_put((struct sdb_splice_ref_t *)buf->private);
+}
+
+static bool rpmsg_sdb_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	struct sdb_splice_ref_t *ref = (struct sdb_splice_ref_t *)buf->private;
+
+	if (!try_get_page(buf->page))
+		return false;
+
+	refcount_inc(&ref->refs);
+	return true;
+}
+
+static const struct pipe_buf_operations rpmsg_sdb_pipe_buf_ops = {
+	.release = rpmsg_sdb_pipe_buf_release,
+	.get = rpmsg_sdb_pipe_buf_get,
+};
+
+/* Check if a completion can be spliced, called with lock held */
+static bool rpmsg_sdb_splice_ready(struct sdb_session_t *session)
+{
+	return session->ring && READ_ONCE(session->ring->consumer) != session->ring_prod;
+}
+
+/*
+ * Take the oldest completion of the ring for splicing: the hold of the session
+ * moves to a splice reference. Returns NULL if the entry is skipped. Called
+ * with mutex held.
+ */
+static struct sdb_splice_ref_t *rpmsg_sdb_splice_take(struct sdb_session_t *session,
+						      struct rpmsg_sdb_ring_entry *entry)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	struct sdb_splice_ref_t *ref;
+	struct sdb_buf_t *buffer;
+	int buffer_id = READ_ONCE(entry->buffer_id);
+
+	ref = kzalloc(sizeof(*ref), GFP_KERNEL);
+	if (!ref)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	buffer = rpmsg_sdb_get_buffer(rpmsg_sdb, buffer_id);
+	/* Already released by userland, or the ring was scribbled on */
+	if (!buffer || !buffer->pooled || !__test_and_clear_bit(buffer_id, session->held)) {
+		spin_unlock_irq(&rpmsg_sdb->lock);
+		kfree(ref);
+		return NULL;
+	}
+	spin_unlock_irq(&rpmsg_sdb->lock);
+
+	ref->drv = rpmsg_sdb;
+	ref->buffer_id = buffer_id;
+	refcount_set(&ref->refs, 1);
+	kref_get(&rpmsg_sdb->kref);
+	/* The pipe buffer ops and rpmsg_sdb_free() are module text */
+	__module_get(THIS_MODULE);
+	atomic_inc(&rpmsg_sdb->pool.maps);
+
+	/* The pages are read through the kernel linear mapping */
+	dma_sync_single_for_cpu(rpmsg_sdb->dev, buffer->paddr, buffer->data_size,
+				buffer->dir);
+
+	return ref;
+}
+
+static ssize_t rpmsg_sdb_splice_read(struct file *file, loff_t *ppos,
+				     struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct sdb_session_t *session = file->private_data;
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	struct sdb_splice_ref_t *ref, *done = NULL;
+	struct rpmsg_sdb_ring_entry *entry;
+	struct pipe_buffer *buf;
+	struct sdb_buf_t *buffer;
+	size_t size, chunk;
+	unsigned int offset;
+	ssize_t spliced = 0;
+	u32 cons;
+	int ret;
+
+again:
+	mutex_lock(&rpmsg_sdb->mutex);
+
+	if (!session->ring || !rpmsg_sdb->pool.vaddr || !rpmsg_sdb->pool.cached ||
+	    (rpmsg_sdb->owner != session && !session->reader)) {
+		mutex_unlock(&rpmsg_sdb->mutex);
+		return -EINVAL;
+	}
+
+	while (!session->splice_ref) {
+		spin_lock_irq(&rpmsg_sdb->lock);
+		ret = rpmsg_sdb_splice_ready(session);
+		spin_unlock_irq(&rpmsg_sdb->lock);
+
+		if (!ret) {
+			mutex_unlock(&rpmsg_sdb->mutex);
+			if ((file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK))
+				return -EAGAIN;
+			ret = wait_event_interruptible(session->wait,
+						       READ_ONCE(session->ring->consumer) !=
+						       READ_ONCE(session->ring_prod));
+			if (ret)
+				return ret;
+			mutex_lock(&rpmsg_sdb->mutex);
+			continue;
+		}
+
+		cons = READ_ONCE(session->ring->consumer);
+		entry = &session->ring->entry[cons & (session->ring_entries - 1)];
+		ref = rpmsg_sdb_splice_take(session, entry);
+		if (IS_ERR(ref)) {
+			mutex_unlock(&rpmsg_sdb->mutex);
+			return PTR_ERR(ref);
+		}
+		if (!ref)
+			smp_store_release(&session->ring->consumer, cons + 1);
+		session->splice_ref = ref;
+		session->splice_off = 0;
+	}
+
+	ref = session->splice_ref;
+	buffer = rpmsg_sdb->buffers[ref->buffer_id];
+	size = min(buffer->data_size, buffer->size);
+
+	/* Move references to the pages, never the data */
+	while (session->splice_off < size && spliced < len &&
+	       !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+		offset = (buffer->paddr + session->splice_off) & ~PAGE_MASK;
+		chunk = min3(size - session->splice_off, len - spliced,
+			     (size_t)(PAGE_SIZE - offset));
+
+		buf = &pipe->bufs[pipe->head & (pipe->ring_size - 1)];
+		buf->page = pfn_to_page((buffer->paddr + session->splice_off) >> PAGE_SHIFT);
+		buf->offset = offset;
+		buf->len = chunk;
+		buf->ops = &rpmsg_sdb_pipe_buf_ops;
+		buf->flags = 0;
+		buf->private = (unsigned long)ref;
+		get_page(buf->page);
+		refcount_inc(&ref->refs);
+		pipe->head++;
+
+		session->splice_off += chunk;
+		spliced += chunk;
+	}
+
+	/* Completion fully spliced, the pipe buffers keep the hold */
+	if (session->splice_off >= size) {
+		cons = READ_ONCE(session->ring->consumer);
+		smp_store_release(&session->ring->consumer, cons + 1);
+		done = ref;
+		session->splice_ref = NULL;
+	}
+
+	mutex_unlock(&rpmsg_sdb->mutex);
+
+	if (done)
+		rpmsg_sdb_splice_ref_put(done);
+
+	/* 0 would mean end of file, skip empty completions */
+	if (!spliced && done) {
+		done = NULL;
+		goto again;
+	}
+
+	return spliced;
+}
+
+static __poll_t rpmsg_sdb_poll(struct file *file, poll_table *wait)
+{
+	struct sdb_session_t *session = file->private_data;
+	struct rpmsg_sdb_t *rpmsg_sdb = session->drv;
+	__poll_t mask = 0;
+
+	poll_wait(file, &session->wait, wait);
+
+	spin_lock_irq(&rpmsg_sdb->lock);
+	if (rpmsg_sdb_splice_ready(session))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irq(&rpmsg_sdb->lock);
+
+	return mask;
+}
+
+static const struct file_operations rpmsg_sdb_fops = {
+	.owner			= THIS_MODULE,
+	.unlocked_ioctl	= rpmsg_sdb_ioctl,
+	.mmap			= rpmsg_sdb_mmap,
+	.splice_read	= rpmsg_sdb_splice_read,
+	.poll			= rpmsg_sdb_poll,
+	.open           = rpmsg_sdb_open,
+	.release        = rpmsg_sdb_close,
+};
+
+/*
+ * Post a completion in the ring of a session, returns false if the ring is
+ * full and the completion dropped. Called with lock held.
+ */
+static bool rpmsg_sdb_ring_post(struct sdb_session_t *session, struct sdb_buf_t *buffer, u32 seq,
+				u32 flags)
+{
+	struct rpmsg_sdb_ring *ring = session->ring;
+	struct rpmsg_sdb_ring_entry *entry;
+	u32 prod = session->ring_prod;
+
+	/* The consumer index is written by userland, only use it for checks */
+	if (prod - READ_ONCE(ring->consumer) >= session->ring_entries) {
+		WRITE_ONCE(ring->dropped, ring->dropped + 1);
+		eventfd_signal(session->ring_efd_ctx, 1);
+		wake_up_interruptible(&session->wait);
+		return false;
+	}
+
+	entry = &ring->entry[prod & (session->ring_entries - 1)];
+	entry->buffer_id = buffer->index;
+	entry->size = buffer->writing_size;
+	entry->seq = seq;
+	entry->flags = flags;
+	entry->timestamp = ktime_to_ns(buffer->done_time);
+
+	/* Publish the entry, then check if the consumer may be sleeping */
+	session->ring_prod = prod + 1;
+	smp_store_release(&ring->producer, prod + 1);
+	smp_mb();
+	if (READ_ONCE(ring->consumer) == prod)
+		eventfd_signal(session->ring_efd_ctx, 1);
+	wake_up_interruptible(&session->wait);
+
+	return true;
+}
+
+/* Hand a completion to a session, called with lock held */
+static void rpmsg_sdb_deliver(struct sdb_session_t *session, struct sdb_buf_t *buffer, u32 seq)
+{
+	if (session->ring) {
+		if (buffer->overrun)
+			WRITE_ONCE(session->ring->overruns, session->drv->overruns);
+		/*
+		 * Userland never sees a dropped completion and can't release it:
+		 * no hold is taken, unless the session still holds the previous
+		 * completion of the buffer, whose ring entry it will release.
+		 */
+		if (!rpmsg_sdb_ring_post(session, buffer, seq,
+					 buffer->overrun ? RPMSG_SDB_RING_F_OVERRUN : 0) &&
+		    !test_bit(buffer->index, session->held))
+			return;
+	}
+
+	/* A session that didn't release the previous completion holds it once */
+	__set_bit(buffer->index, session->held);
+	buffer->holders++;
+}
+
+static void rpmsg_sdb_buffer_done(struct rpmsg_sdb_t *drv, int buffer_id, size_t buffer_size, u32 seq,
+				  ktime_t now)
+{
+	struct sdb_buf_t *buffer;
+	struct sdb_session_t *session;
+	struct rpmsg_device *rpdev;
+	struct rpmsg_sdb_desc desc;
+	unsigned long flags;
+
+	spin_lock_irqsave(&drv->lock, flags);
+
+	buffer = rpmsg_sdb_get_buffer(drv, buffer_id);
+	if (!buffer) {
+		drv->stats.unknown_ids++;
+		spin_unlock_irqrestore(&drv->lock, flags);
+		dev_err(drv->dev, "(%s) Unknown buffer id %d\n", __func__, buffer_id);
+		return;
+	}
+
+	if (buffer_size > buffer->size) {
+		spin_unlock_irqrestore(&drv->lock, flags);
+		dev_err(drv->dev, "(%s) Writing size is bigger than buffer size\n", __func__);
+		return;
+	}
+
+	/* The copro lapped userland, the previous data is lost */
+	if (buffer->state == SDB_BUF_USER) {
+		drv->overruns++;
+		drv->stats.overruns++;
+		buffer->overrun = true;
+	}
+	buffer->state = SDB_BUF_USER;
+	buffer->done_time = now;
+	drv->stats.completions++;
+
+	/* Signal to User space application */
+	buffer->writing_size = buffer_size;
+	buffer->data_size = buffer_size;
+	buffer->holders = 0;
+	if (drv->owner)
+		rpmsg_sdb_deliver(drv->owner, buffer, seq);
+	list_for_each_entry(session, &drv->readers, node) {
+		if (session->ring)
+			rpmsg_sdb_deliver(session, buffer, seq);
+	}
+	if (buffer->efd_ctx)
+		eventfd_signal(buffer->efd_ctx, 1);
+
+	if (buffer->holders) {
+		spin_unlock_irqrestore(&drv->lock, flags);
+		return;
+	}
+
+	/* Nobody to consume it, or only full rings: straight back to the copro */
+	buffer->state = SDB_BUF_COPRO;
+	rpdev = drv->proto_version ? READ_ONCE(drv->rpdev) : NULL;
+	if (rpdev) {
+		rpmsg_sdb_format_txbuf_desc(drv, &desc, RPMSG_SDB_DESC_RELEASE, buffer_id, 0, 0);
+		if (buffer->overrun)
+			desc.flags = cpu_to_le32(RPMSG_SDB_DESC_F_OVERRUN);
+	}
+	buffer->overrun = false;
+	spin_unlock_irqrestore(&drv->lock, flags);
+
+	if (!rpdev)
+		return;
+
+	/* Can't sleep waiting for a tx buffer from the rx callback */
+	if (rpmsg_trysend(rpdev->ept, &desc, sizeof(desc)))
+		dev_err(drv->dev, "(%s) Credit of buffer %d lost\n", __func__, buffer_id);
+}
+
+/*
+ * Handle the binary descriptors of a message. They are parsed in place, a
+ * completion only costs a few loads before the eventfd is signalled.
+ */
+static int rpmsg_sdb_decode_rxbuf_desc(struct rpmsg_sdb_t *drv, const void *data, int len,
+				       ktime_t now)
+{
+	const struct rpmsg_sdb_desc *desc = data;
+	struct rpmsg_sdb_desc reply;
+	struct rpmsg_device *rpdev;
+	unsigned long flags;
+	u32 seq;
+	int ret;
+
+	if (len % sizeof(*desc)) {
+		dev_err(drv->dev, "(%s) Truncated descriptor (%d bytes)\n", __func__, len);
+		return -EINVAL;
+	}
+
+	for (; len > 0; len -= sizeof(*desc), desc++) {
+		if (desc->magic != RPMSG_SDB_DESC_MAGIC || !desc->version) {
+			dev_err(drv->dev, "(%s) Invalid descriptor\n", __func__);
+			return -EINVAL;
+		}
+
+		switch (desc->type) {
+		case RPMSG_SDB_DESC_HELLO:
+			/*
+			 * Retain the highest version supported by both sides. The
+			 * ioctls format their descriptors under the lock, none of
+			 * them mixes the old and the new version or numbering.
+			 */
+			spin_lock_irqsave(&drv->lock, flags);
+			drv->proto_version = min_t(u8, desc->version, RPMSG_SDB_DESC_VERSION);
+			atomic_set(&drv->tx_seq, 0);
+			drv->rx_seq = 0;
+			rpmsg_sdb_format_txbuf_desc(drv, &reply, RPMSG_SDB_DESC_HELLO, 0, 0, 0);
+			rpdev = READ_ONCE(drv->rpdev);
+			spin_unlock_irqrestore(&drv->lock, flags);
+			dev_info(drv->dev, "binary descriptor protocol v%d\n", reply.version);
+			/* The loopback copro, or a removed channel, has nobody to answer */
+			if (!rpdev)
+				break;
+			/* Can't sleep waiting for a tx buffer from the rx callback */
+			ret = rpmsg_trysend(rpdev->ept, &reply, sizeof(reply));
+			if (ret)
+				dev_err(drv->dev, "(%s) HELLO reply failed: %d\n", __func__, ret);
+			break;
+		case RPMSG_SDB_DESC_COMPLETE:
+			seq = le32_to_cpu(desc->seq);
+			if (seq != drv->rx_seq)
+				dev_warn(drv->dev, "(%s) Sequence gap: got %u expected %u\n",
+					 __func__, seq, drv->rx_seq);
+			drv->rx_seq = seq + 1;
+			rpmsg_sdb_buffer_done(drv, le32_to_cpu(desc->buffer_id),
+					      le32_to_cpu(desc->length), seq, now);
+			break;
+		default:
+			dev_err(drv->dev, "(%s) Unexpected descriptor type %d\n", __func__, desc->type);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Handle a message of the copro, real or loopback */
+static int rpmsg_sdb_rx(struct rpmsg_sdb_t *drv, const void *data, int len)
+{
+	int ret = 0, pos = 0;
+	int buffer_id = 0;
+	size_t buffer_size;
+	const char *rpmsg_RxBuf = data;
+	/* All the completions of a message arrived at the same time */
+	ktime_t now = ktime_get();
+
+	if (len == 0) {
+		dev_err(drv->dev, "(%s) Empty lenght requested\n", __func__);
+		return -EINVAL;
+	}
+
+	if ((u8)rpmsg_RxBuf[0] == RPMSG_SDB_DESC_MAGIC)
+		return rpmsg_sdb_decode_rxbuf_desc(drv, data, len, now);
+
+	/*
+	 * When the coprocessor fills buffers faster than the vring is drained,
+	 * several records are coalesced in the same message: walk all of them.
+	 * The records are decoded in place, len is bounded by the RPMSG MTU.
+	 */
+	while (pos < len) {
+		/* Skip string terminators or separators between records */
+		if (rpmsg_RxBuf[pos] == '\0' || isspace(rpmsg_RxBuf[pos])) {
+			pos++;
+			continue;
+		}
+
+		ret = rpmsg_sdb_decode_rxbuf_string(&rpmsg_RxBuf[pos], len - pos,
+						    &buffer_id, &buffer_size);
+		if (ret < 0)
+			return ret;
+
+		pos += ret;
+		/* Legacy records have no sequence number, count them */
+		rpmsg_sdb_buffer_done(drv, buffer_id, buffer_size, drv->rx_seq++, now);
+	}
+
+	return 0;
+}
+
+static int rpmsg_sdb_drv_cb(struct rpmsg_device *rpdev, void *data, int len,
+			void *priv, u32 src)
+{
+	struct rpmsg_sdb_t *drv = dev_get_drvdata(&rpdev->dev);
+
+	/*
+	 * Still probing: no buffer is announced yet, so this can only be a
+	 * HELLO, dropped as if it was sent before the endpoint existed.
+	 */
+	if (!drv)
+		return 0;
+
+	return rpmsg_sdb_rx(drv, data, len);
+}
+
+static int rpmsg_sdb_stats_show(struct seq_file *s, void *unused)
+{
+	struct rpmsg_sdb_t *drv = s->private;
+	struct sdb_stats_t *stats;
+	u64 elapsed;
+	int i, last;
+
+	/* Snapshot the counters, seq_printf can't run under the lock */
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	spin_lock_irq(&drv->lock);
+	*stats = drv->stats;
+	spin_unlock_irq(&drv->lock);
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), stats->since));
+
+	seq_printf(s, "completions: %llu\n", stats->completions);
+	seq_printf(s, "completions/s: %llu\n",
+		   elapsed ? div64_u64(stats->completions * NSEC_PER_SEC, elapsed) : 0);
+	seq_printf(s, "overruns: %llu\n", stats->overruns);
+	seq_printf(s, "unknown ids: %llu\n", stats->unknown_ids);
+	seq_printf(s, "latency samples: %llu\n", stats->lat_count);
+	if (stats->lat_count) {
+		seq_printf(s, "latency min/avg/max (ns): %llu/%llu/%llu\n", stats->lat_min,
+			   div64_u64(stats->lat_sum, stats->lat_count), stats->lat_max);
+
+		for (last = RPMSG_SDB_LAT_BUCKETS - 1; last > 0 && !stats->lat_hist[last]; last--)
+			;
+		seq_puts(s, "latency histogram (us):\n");
+		for (i = 0; i <= last; i++)
+			seq_printf(s, "%s%8lu: %llu\n", i == RPMSG_SDB_LAT_BUCKETS - 1 ? ">=" : "  ",
+				   i ? 1UL << i : 0, stats->lat_hist[i]);
+	}
+
+	kfree(stats);
+	return 0;
+}
+
+static int rpmsg_sdb_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rpmsg_sdb_stats_show, inode->i_private);
+}
+
+/* Any write resets the statistics */
+static ssize_t rpmsg_sdb_stats_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct rpmsg_sdb_t *drv = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock_irq(&drv->lock);
+	rpmsg_sdb_stats_reset(&drv->stats);
+	spin_unlock_irq(&drv->lock);
+
+	return count;
+}
+
+static const struct file_operations rpmsg_sdb_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpmsg_sdb_stats_open,
+	.read		= seq_read,
+	.write		= rpmsg_sdb_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Create an instance and its misc device, for an rpmsg channel or for a
+ * loopback copro, which are set before the device shows up.
+ */
+static struct rpmsg_sdb_t *rpmsg_sdb_create(struct rpmsg_device *rpdev,
+					    struct sdb_loopback_t *lb)
 {
 	int ret = 0;
-	struct device *dev = &rpdev->dev;
 	struct rpmsg_sdb_t *rpmsg_sdb;
 
-	rpmsg_sdb = devm_kzalloc(dev, sizeof(*rpmsg_sdb), GFP_KERNEL);
+	/* Freed by the last of the rpmsg device and the open files */
+	rpmsg_sdb = kzalloc(sizeof(*rpmsg_sdb), GFP_KERNEL);
 	if (!rpmsg_sdb)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
+
+	rpmsg_sdb->id = ida_alloc(&rpmsg_sdb_ida, GFP_KERNEL);
+	if (rpmsg_sdb->id < 0) {
+		ret = rpmsg_sdb->id;
+		kfree(rpmsg_sdb);
+		return ERR_PTR(ret);
+	}
 
+	kref_init(&rpmsg_sdb->kref);
+	INIT_LIST_HEAD(&rpmsg_sdb->readers);
 	mutex_init(&rpmsg_sdb->mutex);
+	spin_lock_init(&rpmsg_sdb->lock);
 
 	rpmsg_sdb->rpdev = rpdev;
-
-	rpmsg_sdb->mdev.name = "rpmsg-sdb";
+	rpmsg_sdb->loopback = lb;
+	/* The loopback copro speaks the binary protocol, no HELLO needed */
+	if (lb)
+		rpmsg_sdb->proto_version = RPMSG_SDB_DESC_VERSION;
+	rpmsg_sdb_stats_reset(&rpmsg_sdb->stats);
+
+	snprintf(rpmsg_sdb->name, sizeof(rpmsg_sdb->name), "rpmsg-sdb%d", rpmsg_sdb->id);
+	rpmsg_sdb->mdev.name = rpmsg_sdb->name;
 	rpmsg_sdb->mdev.minor = MISC_DYNAMIC_MINOR;
 	rpmsg_sdb->mdev.fops = &rpmsg_sdb_fops;
 
-	dev_set_drvdata(&rpdev->dev, rpmsg_sdb);
-
 	/* Register misc device */
 	ret = misc_register(&rpmsg_sdb->mdev);
 
 	if (ret) {
-		dev_err(dev, "Failed to register device\n");
-		goto err_out;
+		pr_err("rpmsg_sdb(ERROR): Failed to register device\n");
+		ida_free(&rpmsg_sdb_ida, rpmsg_sdb->id);
+		kfree(rpmsg_sdb);
+		return ERR_PTR(ret);
 	}
 
-	rpmsg_sdb_dev = rpmsg_sdb->mdev.this_device;
+	/* Kept after misc_deregister() for the buffers of the remaining files */
+	rpmsg_sdb->dev = get_device(rpmsg_sdb->mdev.this_device);
 
-	dev_info(dev, "%s probed\n", rpmsg_sdb_driver_name);
+	rpmsg_sdb->dev->coherent_dma_mask = DMA_BIT_MASK(32);
+	rpmsg_sdb->dev->dma_mask = &rpmsg_sdb->dev->coherent_dma_mask;
 
-err_out:
-	return ret;
+	if (pool_count) {
+		/* Announced to the copro on the first ALLOC_POOL */
+		mutex_lock(&rpmsg_sdb->mutex);
+		if (rpmsg_sdb_alloc_pool(rpmsg_sdb, pool_count, pool_size, pool_cached))
+			dev_warn(rpmsg_sdb->dev, "Failed to preallocate the buffer pool\n");
+		mutex_unlock(&rpmsg_sdb->mutex);
+	}
+
+	/* Statistics in <debugfs>/<misc device name>/stats */
+	rpmsg_sdb->debugfs = debugfs_create_dir(rpmsg_sdb->mdev.name, NULL);
+	debugfs_create_file("stats", 0600, rpmsg_sdb->debugfs, rpmsg_sdb,
+			    &rpmsg_sdb_stats_fops);
+
+	/*
+	 * The endpoint already delivers messages, the callback only sees the
+	 * instance once it is complete. Pairs with the address dependency of
+	 * the callback on the instance pointer.
+	 */
+	if (rpdev) {
+		smp_wmb();
+		dev_set_drvdata(&rpdev->dev, rpmsg_sdb);
+	}
+
+	return rpmsg_sdb;
+}
+
+static void rpmsg_sdb_destroy(struct rpmsg_sdb_t *drv)
+{
+	debugfs_remove_recursive(drv->debugfs);
+	misc_deregister(&drv->mdev);
+
+	/* The open files keep their buffers, but can't talk to the copro anymore */
+	mutex_lock(&drv->mutex);
+	spin_lock_irq(&drv->lock);
+	drv->rpdev = NULL;
+	drv->loopback = NULL;
+	spin_unlock_irq(&drv->lock);
+	mutex_unlock(&drv->mutex);
+
+	kref_put(&drv->kref, rpmsg_sdb_free);
+}
+
+static int rpmsg_sdb_drv_probe(struct rpmsg_device *rpdev)
+{
+	struct rpmsg_sdb_t *rpmsg_sdb;
+
+	rpmsg_sdb = rpmsg_sdb_create(rpdev, NULL);
+	if (IS_ERR(rpmsg_sdb)) {
+		dev_err(&rpdev->dev, "Failed to register device\n");
+		return PTR_ERR(rpmsg_sdb);
+	}
+
+	dev_info(&rpdev->dev, "%s probed as %s\n", rpmsg_sdb_driver_name, rpmsg_sdb->name);
+
+	return 0;
 }
 
 static void rpmsg_sdb_drv_remove(struct rpmsg_device *rpmsgdev)
 {
-	struct rpmsg_sdb_t *drv = dev_get_drvdata(&rpmsgdev->dev);
+	rpmsg_sdb_destroy(dev_get_drvdata(&rpmsgdev->dev));
+}
 
-	misc_deregister(&drv->mdev);
+/*
+ * Loopback
+ *
+ * A kernel thread plays the copro: it fills the buffers the copro owns in
+ * turn, and posts the completions through the same reception path as the
+ * rpmsg messages, at loopback_rate per second. The whole pipeline can then be
+ * benchmarked without the hardware, on any machine with CMA.
+ */
+enum sdb_loopback_pattern {
+	SDB_LOOPBACK_MEMSET = 0, /* every byte set to the sequence number */
+	SDB_LOOPBACK_COUNTER, /* 32-bit counter, continued from buffer to buffer */
+	SDB_LOOPBACK_DUMP, /* recorded capture, replayed in a loop */
+};
+
+struct sdb_loopback_t {
+	struct list_head node; /* in the loopback list */
+	struct rpmsg_sdb_t *drv; /* instance fed by the thread */
+	struct task_struct *task; /* producer thread */
+	enum sdb_loopback_pattern pattern; /* data written in the buffers */
+	const struct firmware *dump; /* recorded capture of the dump pattern */
+	size_t dump_pos; /* next byte of the dump */
+	u32 counter; /* next value of the counter pattern */
+	u32 seq; /* sequence number of the next completion */
+	int next; /* next buffer to fill */
+	wait_queue_head_t wait; /* the thread waits for a buffer to fill */
+	bool kicked; /* a buffer may have become fillable */
+};
+
+static LIST_HEAD(rpmsg_sdb_loopbacks);
+
+/* A pool was allocated or a credit returned, the loopback may go on */
+static void rpmsg_sdb_loopback_kick(struct rpmsg_sdb_t *rpmsg_sdb)
+{
+	struct sdb_loopback_t *lb = rpmsg_sdb->loopback;
+
+	if (!lb)
+		return;
+
+	WRITE_ONCE(lb->kicked, true);
+	wake_up_interruptible(&lb->wait);
+}
+
+static void rpmsg_sdb_loopback_fill(struct sdb_loopback_t *lb, void *vaddr, size_t size)
+{
+	u32 *word = vaddr;
+	size_t pos, chunk;
+
+	switch (lb->pattern) {
+	case SDB_LOOPBACK_MEMSET:
+		memset(vaddr, lb->seq & 0xff, size);
+		break;
+	case SDB_LOOPBACK_COUNTER:
+		for (pos = 0; pos < size / sizeof(*word); pos++)
+			word[pos] = lb->counter++;
+		break;
+	case SDB_LOOPBACK_DUMP:
+		for (pos = 0; pos < size; pos += chunk) {
+			chunk = min(size - pos, lb->dump->size - lb->dump_pos);
+			memcpy(vaddr + pos, lb->dump->data + lb->dump_pos, chunk);
+			lb->dump_pos = (lb->dump_pos + chunk) % lb->dump->size;
+		}
+		break;
+	}
+}
+
+/* Fill the next buffer and return its completion, false if there is none to fill */
+static bool rpmsg_sdb_loopback_produce(struct sdb_loopback_t *lb, struct rpmsg_sdb_desc *desc)
+{
+	struct rpmsg_sdb_t *drv = lb->drv;
+	struct sdb_buf_t *buffer;
+	size_t size;
+	bool ready;
+
+	/* The buffers are only freed with the mutex held */
+	mutex_lock(&drv->mutex);
+
+	spin_lock_irq(&drv->lock);
+	if (lb->next >= drv->nb_buffers)
+		lb->next = 0;
+	buffer = rpmsg_sdb_get_buffer(drv, lb->next);
+	/* Like the firmware, wait for the credit of the buffer */
+	ready = buffer && (buffer->state == SDB_BUF_COPRO || !loopback_credits);
+	spin_unlock_irq(&drv->lock);
+
+	if (!ready) {
+		mutex_unlock(&drv->mutex);
+		return false;
+	}
+
+	size = loopback_size ? min_t(size_t, loopback_size, buffer->size) : buffer->size;
+	rpmsg_sdb_loopback_fill(lb, buffer->vaddr, size);
+
+	/* Written through a cacheable alias, clean it before userland invalidates */
+	if (buffer->cached)
+		dma_sync_single_for_device(drv->dev, buffer->paddr, size, buffer->dir);
+
+	desc->magic = RPMSG_SDB_DESC_MAGIC;
+	desc->version = RPMSG_SDB_DESC_VERSION;
+	desc->type = RPMSG_SDB_DESC_COMPLETE;
+	desc->reserved = 0;
+	desc->flags = 0;
+	desc->seq = cpu_to_le32(lb->seq++);
+	desc->buffer_id = cpu_to_le32(buffer->index);
+	desc->addr = cpu_to_le32(buffer->paddr);
+	desc->length = cpu_to_le32(size);
+
+	lb->next++;
+
+	mutex_unlock(&drv->mutex);
+
+	return true;
+}
+
+static int rpmsg_sdb_loopback_thread(void *data)
+{
+	struct sdb_loopback_t *lb = data;
+	struct rpmsg_sdb_desc desc;
+	ktime_t deadline = ktime_get();
+	unsigned int rate;
+
+	while (!kthread_should_stop()) {
+		/* Cleared before looking at the buffers, a kick from now on is seen */
+		smp_store_mb(lb->kicked, false);
+		if (!rpmsg_sdb_loopback_produce(lb, &desc)) {
+			/* No pool or no credit, sleep until the state changes */
+			wait_event_interruptible(lb->wait, READ_ONCE(lb->kicked) ||
+						 kthread_should_stop());
+			continue;
+		}
+		rpmsg_sdb_rx(lb->drv, &desc, sizeof(desc));
+
+		/* Absolute deadlines, the rate doesn't drift with the fill time */
+		rate = READ_ONCE(loopback_rate);
+		if (!rate) {
+			cond_resched();
+			continue;
+		}
+
+		deadline = ktime_add_ns(deadline, NSEC_PER_SEC / rate);
+		if (ktime_before(deadline, ktime_get()))
+			deadline = ktime_get();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static void rpmsg_sdb_loopback_destroy(struct sdb_loopback_t *lb)
+{
+	kthread_stop(lb->task);
+	rpmsg_sdb_destroy(lb->drv);
+	release_firmware(lb->dump);
+	kfree(lb);
+}
+
+static int rpmsg_sdb_loopback_create(void)
+{
+	struct sdb_loopback_t *lb;
+	int ret;
+
+	lb = kzalloc(sizeof(*lb), GFP_KERNEL);
+	if (!lb)
+		return -ENOMEM;
+	/* Kicked as soon as the pool preallocated at probe exists */
+	init_waitqueue_head(&lb->wait);
+
+	if (!strcmp(loopback_pattern, "memset")) {
+		lb->pattern = SDB_LOOPBACK_MEMSET;
+	} else if (!strcmp(loopback_pattern, "counter")) {
+		lb->pattern = SDB_LOOPBACK_COUNTER;
+	} else if (!strcmp(loopback_pattern, "dump")) {
+		lb->pattern = SDB_LOOPBACK_DUMP;
+	} else {
+		pr_err("rpmsg_sdb(ERROR): Unknown loopback pattern %s\n", loopback_pattern);
+		kfree(lb);
+		return -EINVAL;
+	}
+
+	lb->drv = rpmsg_sdb_create(NULL, lb);
+	if (IS_ERR(lb->drv)) {
+		ret = PTR_ERR(lb->drv);
+		kfree(lb);
+		return ret;
+	}
+
+	if (lb->pattern == SDB_LOOPBACK_DUMP) {
+		ret = request_firmware(&lb->dump, loopback_dump, lb->drv->dev);
+		if (!ret && !lb->dump->size) {
+			release_firmware(lb->dump);
+			ret = -EINVAL;
+		}
+		if (ret) {
+			pr_err("rpmsg_sdb(ERROR): Failed to load loopback dump %s\n", loopback_dump);
+			lb->dump = NULL;
+			goto err_destroy;
+		}
+	}
+
+	lb->task = kthread_run(rpmsg_sdb_loopback_thread, lb, "%s", lb->drv->name);
+	if (IS_ERR(lb->task)) {
+		ret = PTR_ERR(lb->task);
+		goto err_destroy;
+	}
+
+	list_add_tail(&lb->node, &rpmsg_sdb_loopbacks);
+	pr_info("rpmsg_sdb: %s is a loopback instance\n", lb->drv->name);
+
+	return 0;
+
+err_destroy:
+	rpmsg_sdb_destroy(lb->drv);
+	release_firmware(lb->dump);
+	kfree(lb);
+	return ret;
 }
 
 static struct rpmsg_device_id rpmsg_driver_sdb_id_table[] = {
@@ -503,8 +2506,22 @@ static struct rpmsg_driver rpmsg_sdb_rmpsg_drv = {
 	.remove		= rpmsg_sdb_drv_remove,
 };
 
+static void rpmsg_sdb_drv_exit(void)
+{
+	struct sdb_loopback_t *lb, *tmp;
+
+	list_for_each_entry_safe(lb, tmp, &rpmsg_sdb_loopbacks, node) {
+		list_del(&lb->node);
+		rpmsg_sdb_loopback_destroy(lb);
+	}
+
+	unregister_rpmsg_driver(&rpmsg_sdb_rmpsg_drv);
+	pr_info("rpmsg_sdb: Exit\n");
+}
+
 static int __init rpmsg_sdb_drv_init(void)
 {
+	unsigned int i;
 	int ret = 0;
 
 	/* Register rpmsg device */
@@ -515,17 +2532,19 @@ static int __init rpmsg_sdb_drv_init(void)
 		return ret;
 	}
 
+	for (i = 0; i < loopback; i++) {
+		ret = rpmsg_sdb_loopback_create();
+		if (ret) {
+			rpmsg_sdb_drv_exit();
+			return ret;
+		}
+	}
+
 	pr_info("rpmsg_sdb: Init done\n");
 
 	return ret;
 }
 
-static void __exit rpmsg_sdb_drv_exit(void)
-{
-	unregister_rpmsg_driver(&rpmsg_sdb_rmpsg_drv);
-	pr_info("rpmsg_sdb: Exit\n");
-}
-
 module_init(rpmsg_sdb_drv_init);
 module_exit(rpmsg_sdb_drv_exit);
 